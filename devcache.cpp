@@ -0,0 +1,194 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "devcache.h"
+#include "steam/fd.h"
+
+extern bool g_verbose;
+
+struct DeviceCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+};
+
+static const char g_cache_magic[8] = "IMAPDEV";
+static const uint32_t g_cache_version = 1;
+
+std::string cache_dir()
+{
+    std::string dir;
+    if (const char *xdg = getenv("XDG_CACHE_HOME"))
+        dir = xdg;
+    else if (const char *home = getenv("HOME"))
+        dir = std::string(home) + "/.cache";
+    else
+        return std::string();
+    return dir + "/inputmap";
+}
+
+DeviceCache::DeviceCache()
+    :m_map(nullptr), m_map_size(0), m_records(nullptr), m_num_records(0), m_dirty(false)
+{
+    std::string dir = cache_dir();
+    if (dir.empty())
+        return;
+    m_path = dir + "/devices";
+
+    FD fd { open(m_path.c_str(), O_RDONLY | O_CLOEXEC) };
+    if (!fd)
+        return;
+    struct stat st;
+    if (fstat(fd.get(), &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(DeviceCacheHeader))
+        return;
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+    if (map == MAP_FAILED)
+        return;
+    m_map = map;
+    m_map_size = st.st_size;
+
+    const DeviceCacheHeader *hdr = static_cast<const DeviceCacheHeader*>(m_map);
+    if (memcmp(hdr->magic, g_cache_magic, sizeof(hdr->magic)) != 0 ||
+            hdr->version != g_cache_version ||
+            hdr->record_size != sizeof(DeviceCacheRecord) ||
+            hdr->count != (m_map_size - sizeof(DeviceCacheHeader)) / sizeof(DeviceCacheRecord))
+    {
+        if (g_verbose)
+            printf("Ignoring invalid device cache %s\n", m_path.c_str());
+        return;
+    }
+    m_records = reinterpret_cast<const DeviceCacheRecord*>(hdr + 1);
+    m_num_records = hdr->count;
+}
+
+DeviceCache::~DeviceCache()
+{
+    if (m_map)
+        munmap(m_map, m_map_size);
+}
+
+DeviceCacheRecord *DeviceCache::find_current(const std::string &syspath, uint64_t usec)
+{
+    for (auto &rec : m_current)
+    {
+        if (rec.usec_initialized == usec && syspath == rec.syspath)
+            return &rec;
+    }
+    return nullptr;
+}
+
+const DeviceCacheRecord *DeviceCache::find(const std::string &syspath, uint64_t usec)
+{
+    if (usec == 0)
+        return nullptr;
+    if (DeviceCacheRecord *rec = find_current(syspath, usec))
+        return rec;
+    for (size_t i = 0; i < m_num_records; ++i)
+    {
+        const DeviceCacheRecord &rec = m_records[i];
+        if (rec.usec_initialized == usec && strncmp(rec.syspath, syspath.c_str(), sizeof(rec.syspath)) == 0)
+        {
+            m_current.push_back(rec);
+            return &rec;
+        }
+    }
+    return nullptr;
+}
+
+void DeviceCache::add(const DeviceCacheRecord &rec)
+{
+    if (rec.usec_initialized == 0)
+        return;
+    if (DeviceCacheRecord *old = find_current(rec.syspath, rec.usec_initialized))
+    {
+        if (memcmp(old, &rec, sizeof(rec)) == 0)
+            return;
+        *old = rec;
+    }
+    else
+    {
+        m_current.push_back(rec);
+    }
+    m_dirty = true;
+}
+
+bool DeviceCache::find_serial(const std::string &syspath, uint64_t usec, std::string &serial)
+{
+    const DeviceCacheRecord *rec = find(syspath, usec);
+    if (!rec)
+        return false;
+    serial = rec->serial;
+    return true;
+}
+
+void DeviceCache::add_serial(const std::string &syspath, uint64_t usec, const std::string &serial)
+{
+    DeviceCacheRecord rec = {};
+    set_string(rec.syspath, syspath);
+    rec.usec_initialized = usec;
+    set_string(rec.serial, serial);
+    add(rec);
+}
+
+void DeviceCache::save()
+{
+    //records not found in this run are dropped
+    if (!m_dirty && m_current.size() == m_num_records)
+        return;
+    if (m_path.empty())
+        return;
+
+    std::string dir = cache_dir();
+    mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0755);
+    mkdir(dir.c_str(), 0755);
+
+    //write a new file and rename it, as the old one may still be mapped
+    std::string tmp = m_path + ".tmp";
+    FD fd { open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) };
+    if (!fd)
+    {
+        if (g_verbose)
+            perror(tmp.c_str());
+        return;
+    }
+    DeviceCacheHeader hdr = {};
+    memcpy(hdr.magic, g_cache_magic, sizeof(hdr.magic));
+    hdr.version = g_cache_version;
+    hdr.record_size = sizeof(DeviceCacheRecord);
+    hdr.count = m_current.size();
+    size_t size = m_current.size() * sizeof(DeviceCacheRecord);
+    if (write(fd.get(), &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            write(fd.get(), m_current.data(), size) != static_cast<ssize_t>(size) ||
+            rename(tmp.c_str(), m_path.c_str()) < 0)
+    {
+        if (g_verbose)
+            perror(m_path.c_str());
+        unlink(tmp.c_str());
+        return;
+    }
+    m_dirty = false;
+}
@@ -0,0 +1,88 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef DEVCACHE_H_INCLUDED
+#define DEVCACHE_H_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "steam/steamcontroller.h"
+
+//$XDG_CACHE_HOME/inputmap or ~/.cache/inputmap, empty if there is no home
+std::string cache_dir();
+
+//A record of the cache file. They have a fixed size so that the file can be used directly from a mmap.
+struct DeviceCacheRecord
+{
+    char syspath[256];
+    uint64_t usec_initialized;
+    uint16_t bustype, vendor, product, version;
+    char name[128];
+    char uniq[64];
+    char serial[64];
+};
+
+//On-disk cache of the identities of the input devices: vendor, product, name, uniq, serial...
+//so that the devices do not have to be opened and queried on every start.
+//Records are keyed by the sysfs path and the udev USEC_INITIALIZED, that changes whenever the device is plugged again.
+//Only the records that are found or added are saved, so that unplugged devices are forgotten.
+class DeviceCache : public ISteamSerialCache
+{
+public:
+    DeviceCache();
+    ~DeviceCache();
+    DeviceCache(const DeviceCache &) = delete;
+    DeviceCache &operator=(const DeviceCache &) = delete;
+
+    //The returned pointer is valid until the next call to find() or add()
+    const DeviceCacheRecord *find(const std::string &syspath, uint64_t usec);
+    void add(const DeviceCacheRecord &rec);
+    //Writes the file, if anything changed
+    void save();
+
+    bool find_serial(const std::string &syspath, uint64_t usec, std::string &serial) override;
+    void add_serial(const std::string &syspath, uint64_t usec, const std::string &serial) override;
+
+    template <size_t N>
+    static void set_string(char (&dst)[N], const std::string &src)
+    {
+        size_t len = std::min(src.size(), N - 1);
+        memcpy(dst, src.data(), len);
+        memset(dst + len, 0, N - len);
+    }
+
+private:
+    std::string m_path;
+    void *m_map;
+    size_t m_map_size;
+    const DeviceCacheRecord *m_records;
+    size_t m_num_records;
+    //records to be saved
+    std::vector<DeviceCacheRecord> m_current;
+    bool m_dirty;
+
+    DeviceCacheRecord *find_current(const std::string &syspath, uint64_t usec);
+};
+
+#endif /* DEVCACHE_H_INCLUDED */
@@ -20,9 +20,82 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <math.h>
+#include <string.h>
 #include "devinput-parser.h"
 #include "devinput.h"
 #include "quaternion.h"
+#include "progcache.h"
+
+//The constants are saved as the raw bits of value_t, so that they are loaded exactly as they were parsed
+static uint32_t value_bits(value_t v)
+{
+#ifdef INPUTMAP_FIXED_POINT
+    return static_cast<uint32_t>(v.raw());
+#else
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+#endif
+}
+
+static value_t bits_value(uint32_t bits)
+{
+#ifdef INPUTMAP_FIXED_POINT
+    return Fixed::from_raw(static_cast<int32_t>(bits));
+#else
+    value_t v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+#endif
+}
+
+void ExprWriter::constant(value_t v)
+{
+    m_words.push_back(OpConst);
+    m_words.push_back(value_bits(v));
+}
+
+void ExprWriter::ref(const std::shared_ptr<InputDevice> &dev, const ValueId &id)
+{
+    if (!dev)
+    {
+        m_ok = false;
+        return;
+    }
+    m_words.push_back(OpRef);
+    string(dev->name());
+    m_words.push_back(id.type);
+    m_words.push_back(id.code);
+}
+
+void ExprWriter::variable(const std::string &name)
+{
+    m_words.push_back(OpVariable);
+    string(name);
+}
+
+void ExprWriter::op(Op op, int arg)
+{
+    m_words.push_back(op);
+    if (op == OpOper || op == OpUnary)
+        m_words.push_back(arg);
+}
+
+void ExprWriter::func(const char *name, size_t argc)
+{
+    m_words.push_back(OpFunc);
+    string(name);
+    m_words.push_back(argc);
+}
+
+//The length in bytes, then the bytes padded to a full word
+void ExprWriter::string(const std::string &s)
+{
+    m_words.push_back(s.size());
+    size_t pos = m_words.size();
+    m_words.resize(pos + (s.size() + 3) / 4);
+    memcpy(&m_words[pos], s.data(), s.size());
+}
 
 value_t ValueRef::get_value()
 {
@@ -32,11 +105,28 @@ value_t ValueRef::get_value()
     return dev->get_value(m_value_id);
 }
 
+bool ValueRef::get_raw_abs(const input_absinfo &range, int &value)
+{
+    if (m_value_id.type != EV_ABS)
+        return false;
+    auto dev = m_device.lock();
+    if (!dev)
+        return false;
+    return dev->get_raw_abs(m_value_id.code, range, value);
+}
+
 value_t ValueCond::get_value()
 {
     value_t c = m_cond->get_value();
     return (c ? m_true : m_false)->get_value();
 }
+void ValueCond::save(ExprWriter &w) const
+{
+    w.expr(*m_cond);
+    w.expr(*m_true);
+    w.expr(*m_false);
+    w.op(ExprWriter::OpCond);
+}
 bool ValueCond::is_constant() const
 {
     if (!m_cond->is_constant())
@@ -81,6 +171,12 @@ value_t ValueOper::get_value()
         return 0;
     }
 }
+void ValueOper::save(ExprWriter &w) const
+{
+    w.expr(*m_left);
+    w.expr(*m_right);
+    w.op(ExprWriter::OpOper, m_oper);
+}
 bool ValueOper::is_constant() const
 {
     if (!m_left->is_constant())
@@ -94,7 +190,7 @@ bool ValueOper::is_constant() const
     case InputToken_AND:
         return !a;
     case InputToken_OR:
-        return a;
+        return a != 0;
     default:
         return false;
     }
@@ -113,21 +209,33 @@ value_t ValueUnary::get_value()
     }
 }
 
+void ValueUnary::save(ExprWriter &w) const
+{
+    w.expr(*m_expr);
+    w.op(ExprWriter::OpUnary, m_oper);
+}
+
 //////////////////////////
 // Functions
 
 class ValueFunc1 : public ValueExpr
 {
 public:
-    ValueFunc1(value_t (*f)(value_t), std::unique_ptr<ValueExpr> &&e1)
-        :m_fun(f), m_e1(std::move(e1))
+    ValueFunc1(const char *name, value_t (*f)(value_t), std::unique_ptr<ValueExpr> &&e1)
+        :m_name(name), m_fun(f), m_e1(std::move(e1))
     {
     }
     value_t get_value() override
     {
         return m_fun(m_e1->get_value());
     }
+    void save(ExprWriter &w) const override
+    {
+        w.expr(*m_e1);
+        w.func(m_name, 1);
+    }
 private:
+    const char *m_name;
     value_t (*m_fun)(value_t);
     std::unique_ptr<ValueExpr> m_e1;
 };
@@ -135,15 +243,22 @@ private:
 class ValueFunc2 : public ValueExpr
 {
 public:
-    ValueFunc2(value_t (*f)(value_t,value_t), std::unique_ptr<ValueExpr> &&e1, std::unique_ptr<ValueExpr> &&e2)
-        :m_fun(f), m_e1(std::move(e1)), m_e2(std::move(e2))
+    ValueFunc2(const char *name, value_t (*f)(value_t,value_t), std::unique_ptr<ValueExpr> &&e1, std::unique_ptr<ValueExpr> &&e2)
+        :m_name(name), m_fun(f), m_e1(std::move(e1)), m_e2(std::move(e2))
     {
     }
     value_t get_value() override
     {
         return m_fun(m_e1->get_value(), m_e2->get_value());
     }
+    void save(ExprWriter &w) const override
+    {
+        w.expr(*m_e1);
+        w.expr(*m_e2);
+        w.func(m_name, 2);
+    }
 private:
+    const char *m_name;
     value_t (*m_fun)(value_t,value_t);
     std::unique_ptr<ValueExpr> m_e1, m_e2;
 };
@@ -151,36 +266,44 @@ private:
 class ValueFunc3 : public ValueExpr
 {
 public:
-    ValueFunc3(value_t (*f)(value_t,value_t,value_t), std::unique_ptr<ValueExpr> &&e1, std::unique_ptr<ValueExpr> &&e2, std::unique_ptr<ValueExpr> &&e3)
-        :m_fun(f), m_e1(std::move(e1)), m_e2(std::move(e2)), m_e3(std::move(e3))
+    ValueFunc3(const char *name, value_t (*f)(value_t,value_t,value_t), std::unique_ptr<ValueExpr> &&e1, std::unique_ptr<ValueExpr> &&e2, std::unique_ptr<ValueExpr> &&e3)
+        :m_name(name), m_fun(f), m_e1(std::move(e1)), m_e2(std::move(e2)), m_e3(std::move(e3))
     {
     }
     value_t get_value() override
     {
         return m_fun(m_e1->get_value(), m_e2->get_value(), m_e3->get_value());
     }
+    void save(ExprWriter &w) const override
+    {
+        w.expr(*m_e1);
+        w.expr(*m_e2);
+        w.expr(*m_e3);
+        w.func(m_name, 3);
+    }
 private:
+    const char *m_name;
     value_t (*m_fun)(value_t,value_t,value_t);
     std::unique_ptr<ValueExpr> m_e1, m_e2, m_e3;
 };
 
-ValueExpr *create_func_ex(value_t(*f)(value_t), std::vector<std::unique_ptr<ValueExpr>> &&exprs)
+ValueExpr *create_func_ex(const char *name, value_t(*f)(value_t), std::vector<std::unique_ptr<ValueExpr>> &&exprs)
 {
     if (exprs.size() != 1)
         throw std::runtime_error("wrong number of arguments in function");
-    return new ValueFunc1(f, std::move(exprs[0]));
+    return new ValueFunc1(name, f, std::move(exprs[0]));
 }
-ValueExpr *create_func_ex(value_t(*f)(value_t,value_t), std::vector<std::unique_ptr<ValueExpr>> &&exprs)
+ValueExpr *create_func_ex(const char *name, value_t(*f)(value_t,value_t), std::vector<std::unique_ptr<ValueExpr>> &&exprs)
 {
     if (exprs.size() != 2)
         throw std::runtime_error("wrong number of arguments in function");
-    return new ValueFunc2(f, std::move(exprs[0]), std::move(exprs[1]));
+    return new ValueFunc2(name, f, std::move(exprs[0]), std::move(exprs[1]));
 }
-ValueExpr *create_func_ex(value_t(*f)(value_t,value_t,value_t), std::vector<std::unique_ptr<ValueExpr>> &&exprs)
+ValueExpr *create_func_ex(const char *name, value_t(*f)(value_t,value_t,value_t), std::vector<std::unique_ptr<ValueExpr>> &&exprs)
 {
     if (exprs.size() != 3)
         throw std::runtime_error("wrong number of arguments in function");
-    return new ValueFunc3(f, std::move(exprs[0]), std::move(exprs[1]), std::move(exprs[2]));
+    return new ValueFunc3(name, f, std::move(exprs[0]), std::move(exprs[1]), std::move(exprs[2]));
 }
 
 value_t func_between(value_t a, value_t b, value_t c)
@@ -231,6 +354,12 @@ public:
         }
         return x - old;
     }
+    void save(ExprWriter &w) const override
+    {
+        w.expr(*m_touch);
+        w.expr(*m_x);
+        w.func("mouse", 2);
+    }
 private:
     std::unique_ptr<ValueExpr> m_touch, m_x, m_fuzz;
     bool m_touching;
@@ -256,6 +385,12 @@ public:
         m_old = m;
         return res;
     }
+    void save(ExprWriter &w) const override
+    {
+        w.expr(*m_x);
+        w.expr(*m_step);
+        w.func("step", 2);
+    }
 private:
     std::unique_ptr<ValueExpr> m_x, m_step;
     value_t m_old;
@@ -287,6 +422,12 @@ public:
         m_old = x;
         return x;
     }
+    void save(ExprWriter &w) const override
+    {
+        w.expr(*m_x);
+        w.expr(*m_fuzz);
+        w.func("defuzz", 2);
+    }
 private:
     std::unique_ptr<ValueExpr> m_x, m_fuzz;
     bool m_touching;
@@ -309,6 +450,11 @@ public:
             m_clicked = false;
         return m_clicked? 1 : 0;
     }
+    void save(ExprWriter &w) const override
+    {
+        w.expr(*m_x);
+        w.func("turbo", 1);
+    }
 private:
     std::unique_ptr<ValueExpr> m_x;
     bool m_clicked;
@@ -329,6 +475,12 @@ public:
         m_prev = x;
         return m_current;
     }
+    void save(ExprWriter &w) const override
+    {
+        w.expr(*m_x);
+        w.constant(m_states);
+        w.func("toggle", 2);
+    }
 private:
     std::unique_ptr<ValueExpr> m_x;
     bool m_prev;
@@ -349,6 +501,11 @@ public:
         m_prev = x;
         return res;
     }
+    void save(ExprWriter &w) const override
+    {
+        w.expr(*m_x);
+        w.func("edge", 1);
+    }
 private:
     std::unique_ptr<ValueExpr> m_x;
     bool m_prev;
@@ -363,13 +520,11 @@ public:
     }
     value_t get_value() override
     {
+        //pairwise, so that the squares do not overflow a fixed point value_t
         value_t res = 0;
         for (auto &e: m_exprs)
-        {
-            value_t x = e->get_value();
-            res += x*x;
-        }
-        return sqrt(res);
+            res = hypot(res, e->get_value());
+        return res;
     }
     bool is_constant() const override
     {
@@ -378,6 +533,12 @@ public:
                 return false;
         return true;
     }
+    void save(ExprWriter &w) const override
+    {
+        for (auto &e: m_exprs)
+            w.expr(*e);
+        w.func("hypot", m_exprs.size());
+    }
 private:
     std::vector<std::unique_ptr<ValueExpr>> m_exprs;
 };
@@ -399,6 +560,12 @@ public:
     {
         return m_y->is_constant() && m_x->is_constant();
     }
+    void save(ExprWriter &w) const override
+    {
+        w.expr(*m_y);
+        w.expr(*m_x);
+        w.func("atan2", 2);
+    }
 private:
     std::unique_ptr<ValueExpr> m_y, m_x;
 };
@@ -473,6 +640,17 @@ public:
         }
     }
 
+    void save(ExprWriter &w) const override
+    {
+        if (m_trig)
+            w.expr(*m_trig);
+        w.expr(*m_w);
+        w.expr(*m_x);
+        w.expr(*m_y);
+        w.expr(*m_z);
+        w.func("quaternion", m_trig ? 5 : 4);
+    }
+
 private:
     std::unique_ptr<ValueExpr> m_trig, m_w, m_x, m_y, m_z;
     bool m_triggered;
@@ -523,6 +701,17 @@ public:
     {
         return m_radius;
     }
+    void save(ExprWriter &w) const override
+    {
+        w.expr(*m_x);
+        w.expr(*m_y);
+        w.func("polar", 2);
+        if (m_rotation)
+        {
+            w.expr(*m_rotation);
+            w.func("rotate", 2);
+        }
+    }
 private:
     std::unique_ptr<ValueExpr> m_x, m_y, m_rotation;
     value_t m_angle, m_radius;
@@ -539,6 +728,12 @@ public:
     {
         return m_expr->get_field(m_field);
     }
+    void save(ExprWriter &w) const override
+    {
+        static const char *const names[] = {"get_x", "get_y", "get_z", "get_yaw", "get_pitch", "get_roll", "get_angle", "get_radius"};
+        w.expr(*m_expr);
+        w.func(names[static_cast<int>(m_field)], 1);
+    }
 private:
     std::unique_ptr<ValueExpr> m_expr;
     Field m_field;
@@ -550,15 +745,15 @@ ValueExpr* create_func(const std::string &name, std::vector<std::unique_ptr<Valu
     {
         if (name == "bool")
         {
-            return create_func_ex(func_bool, std::move(exprs));
+            return create_func_ex("bool", func_bool, std::move(exprs));
         }
         else if (name == "between")
         {
-            return create_func_ex(func_between, std::move(exprs));
+            return create_func_ex("between", func_between, std::move(exprs));
         }
         else if (name == "between_angle")
         {
-            return create_func_ex(func_between_angle, std::move(exprs));
+            return create_func_ex("between_angle", func_between_angle, std::move(exprs));
         }
         if (name == "deg")
         {
@@ -758,7 +953,33 @@ ValueRef *create_value_ref(const std::string &sdev, const std::string &saxis, II
     return new ValueRef(dev, value_id);
 }
 
+static ProgramCache *g_program_cache;
+
+void set_program_cache(ProgramCache *cache)
+{
+    g_program_cache = cache;
+}
+
+static std::unique_ptr<ValueExpr> parse_ref_text(const std::string &desc, IInputByName &finder);
+
 std::unique_ptr<ValueExpr> parse_ref(const std::string &desc, IInputByName &finder)
+{
+    if (!g_program_cache)
+        return parse_ref_text(desc, finder);
+
+    size_t size;
+    if (const uint32_t *words = g_program_cache->find(desc, size))
+        return load_program(words, size, finder);
+
+    std::unique_ptr<ValueExpr> res = parse_ref_text(desc, finder);
+    ExprWriter w;
+    w.expr(*res);
+    if (w.ok())
+        g_program_cache->add(desc, std::move(w.program()));
+    return res;
+}
+
+static std::unique_ptr<ValueExpr> parse_ref_text(const std::string &desc, IInputByName &finder)
 {
     DevInputArgs args{ finder };
     void *parser = DevInputParseAlloc(malloc);
@@ -851,6 +1072,117 @@ std::unique_ptr<ValueExpr> parse_ref(const std::string &desc, IInputByName &find
     return std::unique_ptr<ValueExpr>(args.input);
 }
 
+class ProgramReader
+{
+public:
+    ProgramReader(const uint32_t *words, size_t size)
+        :m_pos(words), m_end(words + size)
+    {}
+    bool done() const
+    { return m_pos == m_end; }
+    uint32_t word()
+    {
+        if (m_pos == m_end)
+            throw std::runtime_error("invalid program");
+        return *m_pos++;
+    }
+    std::string string()
+    {
+        size_t len = word();
+        size_t nwords = (len + 3) / 4;
+        if (static_cast<size_t>(m_end - m_pos) < nwords)
+            throw std::runtime_error("invalid program");
+        std::string res(reinterpret_cast<const char*>(m_pos), len);
+        m_pos += nwords;
+        return res;
+    }
+private:
+    const uint32_t *m_pos, *m_end;
+};
+
+std::unique_ptr<ValueExpr> load_program(const uint32_t *words, size_t size, IInputByName &finder)
+{
+    ProgramReader rd(words, size);
+    std::vector<std::unique_ptr<ValueExpr>> stack;
+    auto pop = [&stack]()
+    {
+        if (stack.empty())
+            throw std::runtime_error("invalid program");
+        std::unique_ptr<ValueExpr> e = std::move(stack.back());
+        stack.pop_back();
+        return e;
+    };
+    while (!rd.done())
+    {
+        switch (rd.word())
+        {
+        case ExprWriter::OpConst:
+            stack.emplace_back(new ValueConst(bits_value(rd.word())));
+            break;
+        case ExprWriter::OpRef:
+            {
+                std::string sdev = rd.string();
+                ValueId id;
+                id.type = rd.word();
+                id.code = rd.word();
+                auto dev = finder.find_input(sdev);
+                if (!dev)
+                    throw std::runtime_error("unknown device in ref: " + sdev);
+                dev->use_value(id);
+                stack.emplace_back(new ValueRef(dev, id));
+            }
+            break;
+        case ExprWriter::OpVariable:
+            {
+                std::string name = rd.string();
+                Variable *v = finder.find_variable(name);
+                if (!v)
+                    throw std::runtime_error("undefined variable: " + name);
+                stack.emplace_back(new ValueVariable(v, name));
+            }
+            break;
+        case ExprWriter::OpCond:
+            {
+                auto f = pop(), t = pop(), c = pop();
+                stack.emplace_back(new ValueCond(c.release(), t.release(), f.release()));
+            }
+            break;
+        case ExprWriter::OpOper:
+            {
+                int oper = rd.word();
+                auto r = pop(), l = pop();
+                stack.emplace_back(new ValueOper(oper, l.release(), r.release()));
+            }
+            break;
+        case ExprWriter::OpUnary:
+            {
+                int oper = rd.word();
+                auto e = pop();
+                stack.emplace_back(new ValueUnary(oper, e.release()));
+            }
+            break;
+        case ExprWriter::OpFunc:
+            {
+                std::string name = rd.string();
+                size_t argc = rd.word();
+                if (argc > stack.size())
+                    throw std::runtime_error("invalid program");
+                std::vector<std::unique_ptr<ValueExpr>> exprs;
+                for (auto it = stack.end() - argc; it != stack.end(); ++it)
+                    exprs.push_back(std::move(*it));
+                stack.resize(stack.size() - argc);
+                stack.emplace_back(create_func(name, std::move(exprs)));
+            }
+            break;
+        default:
+            throw std::runtime_error("invalid program");
+        }
+    }
+    if (stack.size() != 1)
+        throw std::runtime_error("invalid program");
+    return pop();
+}
+
 ValueExpr* optimize(ValueExpr *expr)
 {
     //I will only do basic optimizations. No bytecode or anything fancy.
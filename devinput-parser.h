@@ -24,8 +24,12 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <string>
 #include <memory>
+#include <vector>
+#include <stdint.h>
 #include "inputdev.h"
 
+class ExprWriter;
+
 struct ValueExpr
 {
     enum class Field
@@ -45,6 +49,44 @@ struct ValueExpr
     { return 0; }
     virtual bool is_constant() const
     { return false; }
+    //Writes the expression as a program, see load_program()
+    virtual void save(ExprWriter &w) const =0;
+};
+
+//Writes expression trees as programs: a flat list of words in postfix order, that load_program() can
+//turn back into the same tree without tokenizing or parsing anything.
+class ExprWriter
+{
+public:
+    enum Op : uint32_t
+    {
+        OpConst,    //value
+        OpRef,      //device name, type, code
+        OpVariable, //name
+        OpCond,     //pops 3
+        OpOper,     //operator, pops 2
+        OpUnary,    //operator, pops 1
+        OpFunc,     //name, number of arguments, pops them
+    };
+
+    void expr(const ValueExpr &e)
+    { e.save(*this); }
+    void constant(value_t v);
+    void ref(const std::shared_ptr<InputDevice> &dev, const ValueId &id);
+    void variable(const std::string &name);
+    void op(Op op, int arg = 0);
+    void func(const char *name, size_t argc);
+
+    //false if anything cannot be written, such as a reference to a device that is gone
+    bool ok() const
+    { return m_ok; }
+    std::vector<uint32_t> &program()
+    { return m_words; }
+private:
+    std::vector<uint32_t> m_words;
+    bool m_ok = true;
+
+    void string(const std::string &s);
 };
 
 class Variable
@@ -103,6 +145,8 @@ public:
     value_t get_value() override { return m_value; }
     bool is_constant() const override
     { return true; }
+    void save(ExprWriter &w) const override
+    { w.constant(m_value); }
 private:
     value_t m_value;
 };
@@ -115,10 +159,14 @@ public:
     {
     }
     value_t get_value() override;
+    void save(ExprWriter &w) const override
+    { w.ref(m_device.lock(), m_value_id); }
     std::shared_ptr<InputDevice> get_device()
     {
         return m_device.lock();
     }
+    //Integer passthrough of an ABS axis, see InputDevice::get_raw_abs()
+    bool get_raw_abs(const input_absinfo &range, int &value);
     const ValueId &get_value_id() const
     {
         return m_value_id;
@@ -137,6 +185,7 @@ public:
     }
     value_t get_value() override;
     bool is_constant() const override;
+    void save(ExprWriter &w) const override;
 private:
     std::unique_ptr<ValueExpr> m_cond, m_true, m_false;
 };
@@ -150,6 +199,7 @@ public:
     }
     value_t get_value() override;
     bool is_constant() const override;
+    void save(ExprWriter &w) const override;
 private:
     int m_oper;
     std::unique_ptr<ValueExpr> m_left, m_right;
@@ -165,6 +215,7 @@ public:
     value_t get_value() override;
     bool is_constant() const override
     { return m_expr->is_constant(); }
+    void save(ExprWriter &w) const override;
 private:
     int m_oper;
     std::unique_ptr<ValueExpr> m_expr;
@@ -173,8 +224,8 @@ private:
 class ValueVariable : public ValueExpr
 {
 public:
-    ValueVariable(const Variable *var)
-        :m_var(var)
+    ValueVariable(const Variable *var, const std::string &name)
+        :m_var(var), m_name(name)
     {
     }
     value_t get_value() override
@@ -183,14 +234,23 @@ public:
     { return m_var->get_field(field); }
     bool is_constant() const override
     { return m_var->is_constant(); }
+    void save(ExprWriter &w) const override
+    { w.variable(m_name); }
 private:
     const Variable *m_var;
+    std::string m_name;
 };
 
 ValueRef *create_value_ref(const std::string &sdev, const std::string &saxis, IInputByName &finder);
 ValueExpr* create_func(const std::string &name, std::vector<std::unique_ptr<ValueExpr>> &&exprs);
 
 std::unique_ptr<ValueExpr> parse_ref(const std::string &desc, IInputByName &finder);
+//Rebuilds an expression written by ExprWriter
+std::unique_ptr<ValueExpr> load_program(const uint32_t *words, size_t size, IInputByName &finder);
+
+class ProgramCache;
+//While set, parse_ref() takes the programs from the cache, and adds the new ones
+void set_program_cache(ProgramCache *cache);
 ValueExpr* optimize(ValueExpr *expr);
 
 #endif /* DEVINPUT_PARSER_H_INCLUDED */
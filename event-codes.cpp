@@ -19,6 +19,8 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 
 */
 
+#include <string.h>
+#include <algorithm>
 #include "event-codes.h"
 
 #define BeginKey() EventName g_key_names[KEY_CNT] = {
@@ -41,3 +43,117 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 #include "event-codes.inc"
 
 
+
+void EventNameIndex::add(int type, const EventName *names, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!names[i].name)
+            continue;
+        m_codes.push_back(EventCode{type, names[i].id, names[i].name});
+    }
+    rehash();
+}
+
+void EventNameIndex::rehash()
+{
+    size_t size = 16;
+    while (size < 2 * m_codes.size())
+        size *= 2;
+    m_slots.assign(size, -1);
+    for (size_t i = 0; i < m_codes.size(); ++i)
+    {
+        const char *name = m_codes[i].name;
+        size_t h = event_name_hash(name, strlen(name)) & (size - 1);
+        while (m_slots[h] != -1)
+        {
+            //keep the first one, as the linear search did
+            if (strcmp(m_codes[m_slots[h]].name, name) == 0)
+                break;
+            h = (h + 1) & (size - 1);
+        }
+        if (m_slots[h] == -1)
+            m_slots[h] = i;
+    }
+}
+
+const EventCode *EventNameIndex::find(const char *name, size_t len) const
+{
+    if (m_slots.empty())
+        return nullptr;
+    size_t mask = m_slots.size() - 1;
+    for (size_t h = event_name_hash(name, len) & mask; m_slots[h] != -1; h = (h + 1) & mask)
+    {
+        const EventCode &ec = m_codes[m_slots[h]];
+        if (strncmp(ec.name, name, len) == 0 && ec.name[len] == 0)
+            return &ec;
+    }
+    return nullptr;
+}
+
+namespace
+{
+
+struct EventCodeTables
+{
+    EventNameIndex index;
+    const char *key[KEY_CNT];
+    const char *rel[REL_CNT];
+    const char *abs[ABS_CNT];
+    const char *ff[FF_CNT];
+
+    EventCodeTables()
+    {
+        index.add(EV_KEY, g_key_names);
+        index.add(EV_REL, g_rel_names);
+        index.add(EV_ABS, g_abs_names);
+        index.add(EV_FF, g_ff_names);
+        fill(key, g_key_names);
+        fill(rel, g_rel_names);
+        fill(abs, g_abs_names);
+        fill(ff, g_ff_names);
+    }
+    template <size_t N>
+    static void fill(const char *(&names)[N], const EventName (&evs)[N])
+    {
+        std::fill(names, names + N, nullptr);
+        for (const auto &kv : evs)
+        {
+            if (kv.name && !names[kv.id])
+                names[kv.id] = kv.name;
+        }
+    }
+};
+
+const EventCodeTables &event_code_tables()
+{
+    static EventCodeTables tables;
+    return tables;
+}
+
+}
+
+const EventCode *find_event_code(const std::string &name)
+{
+    return event_code_tables().index.find(name);
+}
+
+const char *event_code_name(int type, int code)
+{
+    const EventCodeTables &t = event_code_tables();
+    if (code < 0)
+        return nullptr;
+    switch (type)
+    {
+    case EV_KEY:
+        return code < KEY_CNT ? t.key[code] : nullptr;
+    case EV_REL:
+        return code < REL_CNT ? t.rel[code] : nullptr;
+    case EV_ABS:
+        return code < ABS_CNT ? t.abs[code] : nullptr;
+    case EV_FF:
+        return code < FF_CNT ? t.ff[code] : nullptr;
+    default:
+        return nullptr;
+    }
+}
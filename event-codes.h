@@ -22,6 +22,10 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef EVENT_CODES_H_INCLUDED
 #define EVENT_CODES_H_INCLUDED
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
 #include <linux/input.h>
 #include <linux/input-event-codes.h>
 
@@ -36,4 +40,42 @@ extern EventName g_rel_names[REL_CNT];
 extern EventName g_abs_names[ABS_CNT];
 extern EventName g_ff_names[FF_CNT];
 
+struct EventCode
+{
+    int type;
+    int code;
+    const char *name;
+};
+
+//FNV-1a, constexpr so that it can be evaluated at compile time for constant names
+constexpr uint32_t event_name_hash(const char *name, size_t len, uint32_t h = 2166136261U)
+{
+    return len == 0 ? h : event_name_hash(name + 1, len - 1, (h ^ static_cast<uint8_t>(*name)) * 16777619U);
+}
+
+//Hash table from names to event codes, with open addressing.
+//Tables are added once at startup, lookups do not allocate.
+class EventNameIndex
+{
+public:
+    template <size_t N>
+    void add(int type, const EventName (&names)[N])
+    { add(type, names, N); }
+    void add(int type, const EventName *names, size_t count);
+
+    const EventCode *find(const char *name, size_t len) const;
+    const EventCode *find(const std::string &name) const
+    { return find(name.data(), name.size()); }
+private:
+    std::vector<EventCode> m_codes;
+    std::vector<int> m_slots; //indices into m_codes, -1 if empty; size is a power of 2
+
+    void rehash();
+};
+
+//Look up a KEY, REL, ABS or FF code by name, nullptr if not found
+const EventCode *find_event_code(const std::string &name);
+//Name of the given code, nullptr if unknown
+const char *event_code_name(int type, int code);
+
 #endif /* EVENT-CODES_H_INCLUDED */
@@ -0,0 +1,226 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef FIXED_H_INCLUDED
+#define FIXED_H_INCLUDED
+
+#include <stdint.h>
+
+//Q16.16 fixed point number, used as value_t when built with INPUTMAP_FIXED_POINT.
+//All operations saturate instead of overflowing, and a division by zero saturates too.
+class Fixed
+{
+public:
+    static const int Shift = 16;
+    static const int32_t One = 1 << Shift;
+
+    Fixed() :m_raw(0) {}
+    Fixed(int x) :m_raw(sat(static_cast<int64_t>(x) << Shift)) {}
+    Fixed(long x) :m_raw(sat(static_cast<int64_t>(x) * One)) {}
+    Fixed(long long x) :m_raw(sat(static_cast<int64_t>(x) * One)) {}
+    Fixed(unsigned x) :m_raw(sat(static_cast<int64_t>(x) << Shift)) {}
+    Fixed(float x) :Fixed(static_cast<double>(x)) {}
+    Fixed(double x)
+    {
+        x *= One;
+        if (x >= INT32_MAX)
+            m_raw = INT32_MAX;
+        else if (x <= INT32_MIN)
+            m_raw = INT32_MIN;
+        else
+            m_raw = static_cast<int32_t>(x < 0 ? x - 0.5 : x + 0.5);
+    }
+
+    static Fixed from_raw(int64_t raw)
+    {
+        Fixed r;
+        r.m_raw = sat(raw);
+        return r;
+    }
+    //num/den without the intermediate values having to fit
+    static Fixed ratio(int64_t num, int64_t den)
+    {
+        if (den == 0)
+            return Fixed();
+        return from_raw(num * One / den);
+    }
+    int32_t raw() const
+    { return m_raw; }
+
+    //Truncates towards zero, as the float to int conversion does
+    explicit operator int() const
+    { return m_raw / One; }
+    explicit operator float() const
+    { return static_cast<float>(m_raw) / One; }
+    explicit operator double() const
+    { return static_cast<double>(m_raw) / One; }
+    explicit operator bool() const
+    { return m_raw != 0; }
+
+    Fixed operator-() const
+    { return from_raw(-static_cast<int64_t>(m_raw)); }
+    Fixed &operator+=(Fixed b)
+    { return *this = *this + b; }
+    Fixed &operator-=(Fixed b)
+    { return *this = *this - b; }
+    Fixed &operator*=(Fixed b)
+    { return *this = *this * b; }
+    Fixed &operator/=(Fixed b)
+    { return *this = *this / b; }
+
+    friend Fixed operator+(Fixed a, Fixed b)
+    { return from_raw(static_cast<int64_t>(a.m_raw) + b.m_raw); }
+    friend Fixed operator-(Fixed a, Fixed b)
+    { return from_raw(static_cast<int64_t>(a.m_raw) - b.m_raw); }
+    friend Fixed operator*(Fixed a, Fixed b)
+    { return from_raw((static_cast<int64_t>(a.m_raw) * b.m_raw + One / 2) >> Shift); }
+    friend Fixed operator/(Fixed a, Fixed b)
+    {
+        if (b.m_raw == 0)
+            return from_raw(a.m_raw < 0 ? INT32_MIN : INT32_MAX);
+        return from_raw((static_cast<int64_t>(a.m_raw) << Shift) / b.m_raw);
+    }
+
+    friend bool operator==(Fixed a, Fixed b)
+    { return a.m_raw == b.m_raw; }
+    friend bool operator!=(Fixed a, Fixed b)
+    { return a.m_raw != b.m_raw; }
+    friend bool operator<(Fixed a, Fixed b)
+    { return a.m_raw < b.m_raw; }
+    friend bool operator>(Fixed a, Fixed b)
+    { return a.m_raw > b.m_raw; }
+    friend bool operator<=(Fixed a, Fixed b)
+    { return a.m_raw <= b.m_raw; }
+    friend bool operator>=(Fixed a, Fixed b)
+    { return a.m_raw >= b.m_raw; }
+
+private:
+    int32_t m_raw;
+
+    static int32_t sat(int64_t x)
+    {
+        if (x > INT32_MAX)
+            return INT32_MAX;
+        if (x < INT32_MIN)
+            return INT32_MIN;
+        return static_cast<int32_t>(x);
+    }
+};
+
+//Integer versions of the libm functions used by the expressions
+
+inline uint32_t fixed_isqrt(uint64_t x)
+{
+    uint64_t res = 0;
+    uint64_t bit = uint64_t(1) << 62;
+    while (bit > x)
+        bit >>= 2;
+    while (bit)
+    {
+        if (x >= res + bit)
+        {
+            x -= res + bit;
+            res = (res >> 1) + bit;
+        }
+        else
+        {
+            res >>= 1;
+        }
+        bit >>= 2;
+    }
+    return static_cast<uint32_t>(res);
+}
+
+inline Fixed fabs(Fixed x)
+{ return x < 0 ? -x : x; }
+
+inline Fixed sqrt(Fixed x)
+{
+    if (x.raw() <= 0)
+        return Fixed();
+    return Fixed::from_raw(fixed_isqrt(static_cast<uint64_t>(x.raw()) << Fixed::Shift));
+}
+
+inline Fixed hypot(Fixed x, Fixed y)
+{
+    int64_t a = x.raw(), b = y.raw();
+    return Fixed::from_raw(fixed_isqrt(static_cast<uint64_t>(a * a) + static_cast<uint64_t>(b * b)));
+}
+
+inline Fixed fmod(Fixed a, Fixed b)
+{
+    if (b.raw() == 0)
+        return Fixed();
+    return Fixed::from_raw(a.raw() % b.raw());
+}
+
+//Polynomial approximation of atan() in the first octant, evaluated in Q2.30 so that
+//the rounding of the coefficients does not add much to its 1e-5 rad error
+inline Fixed atan2(Fixed y, Fixed x)
+{
+    static const int64_t Pi = 205887, Pi_2 = 102944;
+    int64_t ax = x.raw(), ay = y.raw();
+    if (ax < 0)
+        ax = -ax;
+    if (ay < 0)
+        ay = -ay;
+    if (ax == 0 && ay == 0)
+        return Fixed();
+
+    bool swap = ay > ax;
+    int64_t z = swap ? (ax << 30) / ay : (ay << 30) / ax;
+    int64_t z2 = (z * z) >> 30;
+    int64_t r = 22371518;
+    r = -91410863 + ((r * z2) >> 30);
+    r = 193424926 + ((r * z2) >> 30);
+    r = -354656388 + ((r * z2) >> 30);
+    r = 1073597943 + ((r * z2) >> 30);
+    r = (r * z + (int64_t(1) << 43)) >> 44;
+
+    if (swap)
+        r = Pi_2 - r;
+    if (x.raw() < 0)
+        r = Pi - r;
+    if (y.raw() < 0)
+        r = -r;
+    return Fixed::from_raw(r);
+}
+
+inline Fixed asin(Fixed x)
+{
+    if (x > 1)
+        x = 1;
+    else if (x < -1)
+        x = -1;
+    return atan2(x, sqrt((1 - x) * (1 + x)));
+}
+
+inline Fixed acos(Fixed x)
+{
+    if (x > 1)
+        x = 1;
+    else if (x < -1)
+        x = -1;
+    return atan2(sqrt((1 - x) * (1 + x)), x);
+}
+
+#endif /* FIXED_H_INCLUDED */
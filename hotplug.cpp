@@ -0,0 +1,123 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdexcept>
+#include <thread>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "hotplug.h"
+
+HotplugMonitor::HotplugMonitor(Callback on_add)
+    :m_udev(udev_new()), m_on_add(std::move(on_add))
+{
+    if (!m_udev)
+        throw std::runtime_error("udev_new");
+    //"udev" and not "kernel", so that the devices are reported after the rules have run: permissions, symlinks...
+    m_monitor.reset(udev_monitor_new_from_netlink(m_udev.get(), "udev"));
+    if (!m_monitor)
+        throw std::runtime_error("udev_monitor_new_from_netlink");
+    udev_monitor_filter_add_match_subsystem_devtype(m_monitor.get(), "input", nullptr);
+    udev_monitor_filter_add_match_subsystem_devtype(m_monitor.get(), "hidraw", nullptr);
+    if (udev_monitor_enable_receiving(m_monitor.get()) < 0)
+        throw std::runtime_error("udev_monitor_enable_receiving");
+}
+
+PollResult HotplugMonitor::on_poll(int event)
+{
+    if ((event & EPOLLIN) == 0)
+        return PollResult::None;
+    udev_device_ptr dev { udev_monitor_receive_device(m_monitor.get()) };
+    if (!dev)
+        return PollResult::None;
+    const char *action = udev_device_get_action(dev.get());
+    if (action && strcmp(action, "add") == 0)
+        m_on_add(dev.get());
+    return PollResult::None;
+}
+
+SteamHotplugProber::SteamHotplugProber(Callback on_probed)
+    :m_on_probed(std::move(on_probed))
+{
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    test(fd, "eventfd");
+    m_wake = FD(fd);
+}
+
+SteamHotplugProber::~SteamHotplugProber()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_running)
+        m_cond.wait(lock);
+}
+
+void SteamHotplugProber::probe(const std::string &syspath)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_running;
+    }
+    std::thread([this, syspath]
+    {
+        std::unique_ptr<Probed> probed;
+        try
+        {
+            SteamController steam = SteamController::Open(syspath, "");
+            std::string serial = steam.get_serial();
+            probed.reset(new Probed{std::move(steam), serial, syspath});
+        }
+        catch (std::exception &e)
+        {
+            //most of the hidraw devices are not SteamControllers
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (probed)
+        {
+            m_done.push_back(std::move(*probed));
+            uint64_t one = 1;
+            while (write(m_wake.get(), &one, sizeof(one)) < 0 && errno == EINTR)
+                ;
+        }
+        --m_running;
+        m_cond.notify_all();
+    }).detach();
+}
+
+PollResult SteamHotplugProber::on_poll(int event)
+{
+    if ((event & EPOLLIN) == 0)
+        return PollResult::None;
+    uint64_t n;
+    if (read(m_wake.get(), &n, sizeof(n)) < 0)
+        return PollResult::None;
+    std::vector<Probed> done;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        done.swap(m_done);
+    }
+    //the controllers that nobody takes are restored and closed here
+    for (auto &p : done)
+        m_on_probed(p.steam, p.serial, p.syspath);
+    return PollResult::None;
+}
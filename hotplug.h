@@ -0,0 +1,86 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef HOTPLUG_H_INCLUDED
+#define HOTPLUG_H_INCLUDED
+
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include "inputdev.h"
+#include "steam/udev-wrapper.h"
+#include "steam/steamcontroller.h"
+
+struct udev_monitor_closer
+{
+    void operator()(udev_monitor *p) noexcept { udev_monitor_unref(p); }
+};
+using udev_monitor_ptr = std::unique_ptr<udev_monitor, udev_monitor_closer>;
+
+//Watches for input and hidraw devices being plugged, so that the detached input devices can take them over.
+class HotplugMonitor : public IPollable
+{
+public:
+    typedef std::function<void (udev_device *dev)> Callback;
+    explicit HotplugMonitor(Callback on_add);
+
+    virtual int fd() override
+    { return udev_monitor_get_fd(m_monitor.get()); }
+    virtual PollResult on_poll(int event) override;
+
+private:
+    udev_ptr m_udev;
+    udev_monitor_ptr m_monitor;
+    Callback m_on_add;
+};
+
+//Opens the SteamControllers plugged and queries their serial numbers from a background thread, because the
+//query may take up to 500 ms, then hands them to the callback from the main loop.
+class SteamHotplugProber : public IPollable
+{
+public:
+    typedef std::function<void (SteamController &steam, const std::string &serial, const std::string &syspath)> Callback;
+    explicit SteamHotplugProber(Callback on_probed);
+    //waits for the probes still running
+    ~SteamHotplugProber();
+    void probe(const std::string &syspath);
+
+    virtual int fd() override
+    { return m_wake.get(); }
+    virtual PollResult on_poll(int event) override;
+
+private:
+    struct Probed
+    {
+        SteamController steam;
+        std::string serial, syspath;
+    };
+    FD m_wake;
+    Callback m_on_probed;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::vector<Probed> m_done;
+    int m_running = 0;
+};
+
+#endif /* HOTPLUG_H_INCLUDED */
@@ -55,10 +55,14 @@ IniFile::IniFile(const std::string &fileName)
 void IniFile::load(std::istream &is)
 {
     std::string line;
+    int line_number = 0, first_line = 1;
     while (is)
     {
         std::string line0;
         std::getline(is, line0);
+        ++line_number;
+        if (line.empty())
+            first_line = line_number;
         line += line0;
         if (!line.empty() && line[line.size() - 1] == '\\')
         {
@@ -83,14 +87,22 @@ void IniFile::load(std::istream &is)
         {
             if (m_sections.empty())
                 throw std::runtime_error("item without section");
-            m_sections.back().add_line(full);
+            m_sections.back().add_line(full, first_line);
         }
     }
+
+    //the sections do not move any more
+    for (auto &s : m_sections)
+    {
+        s.build_index();
+        m_index[s.m_name].push_back(&s);
+    }
 }
 
-void IniSection::add_line(const std::string &line)
+void IniSection::add_line(const std::string &line, int line_number)
 {
     IniEntry entry;
+    entry.m_line = line_number;
     size_t eq = line.find('=');
     if (eq == std::string::npos)
     {
@@ -104,9 +116,21 @@ void IniSection::add_line(const std::string &line)
     m_entries.push_back(entry);
 }
 
+void IniSection::build_index()
+{
+    for (size_t i = 0; i < m_entries.size(); ++i)
+    {
+        auto res = m_index.insert(std::make_pair(m_entries[i].m_name, Slot{i, 0}));
+        ++res.first->second.count;
+    }
+}
+
+static const std::string g_empty_string;
+static const std::vector<const IniSection*> g_no_sections;
+
 const IniSection *IniFile::find_single_section(const std::string &name) const
 {
-    std::vector<const IniSection*> values = find_multi_section(name);
+    const std::vector<const IniSection*> &values = find_multi_section(name);
     if (values.size() > 1)
         throw std::runtime_error("multiple " + name);
     if (values.empty())
@@ -115,36 +139,35 @@ const IniSection *IniFile::find_single_section(const std::string &name) const
         return values.front();
 }
 
-std::vector<const IniSection*> IniFile::find_multi_section(const std::string &name) const
+const std::vector<const IniSection*> &IniFile::find_multi_section(const std::string &name) const
 {
-    std::vector<const IniSection*> res;
-    for (auto &s : m_sections)
-    {
-        if (s.m_name == name)
-            res.push_back(&s);
-    }
-    return res;
+    auto it = m_index.find(name);
+    if (it == m_index.end())
+        return g_no_sections;
+    return it->second;
 }
 
-std::string IniSection::find_single_value(const std::string &name) const
+const std::string &IniSection::find_single_value(const std::string &name) const
 {
-    std::vector<std::string> values = find_multi_value(name);
-    if (values.size() > 1)
+    auto it = m_index.find(name);
+    if (it == m_index.end())
+        return g_empty_string;
+    if (it->second.count > 1)
         throw std::runtime_error("multiple " + name);
-    if (values.empty())
-        return std::string();
-    else
-        return values.front();
+    return m_entries[it->second.first].m_value;
 }
 
 std::vector<std::string> IniSection::find_multi_value(const std::string &name) const
 {
     std::vector<std::string> res;
-    for (auto &e : m_entries)
+    auto it = m_index.find(name);
+    if (it == m_index.end())
+        return res;
+    res.reserve(it->second.count);
+    for (size_t i = it->second.first; res.size() < it->second.count; ++i)
     {
-        if (e.m_name == name)
-            res.push_back(e.m_value);
+        if (m_entries[i].m_name == name)
+            res.push_back(m_entries[i].m_value);
     }
     return res;
 }
-
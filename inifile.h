@@ -24,6 +24,7 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include <sstream>
 
 inline bool parse_bool(const std::string &txt, bool def)
@@ -58,25 +59,30 @@ class IniEntry
 friend class IniFile;
 friend class IniSection;
 public:
+    //filter(std::string &value, int line) modifies the value in place
     template<typename F>
     void preprocess_value(F filter)
     {
-        m_value = filter(std::move(m_value));
+        filter(m_value, m_line);
     }
-    const std::string name() const
+    const std::string &name() const
     { return m_name; }
-    const std::string value() const
+    const std::string &value() const
     { return m_value; }
+    //in the file, 1-based
+    int line() const
+    { return m_line; }
 private:
     std::string m_name;
     std::string m_value;
+    int m_line;
 };
 
 class IniSection
 {
 friend class IniFile;
 public:
-    const std::string name() const
+    const std::string &name() const
     { return m_name; }
     template<typename F>
     void preprocess_values(F filter)
@@ -84,7 +90,8 @@ public:
         for (auto &v : m_entries)
             v.preprocess_value(filter);
     }
-    std::string find_single_value(const std::string &name) const;
+    //Returns an empty string if not found, the reference is valid as long as the IniFile
+    const std::string &find_single_value(const std::string &name) const;
     std::vector<std::string> find_multi_value(const std::string &name) const;
 
     typedef std::vector<IniEntry>::const_iterator entry_iterator;
@@ -93,16 +100,26 @@ public:
     entry_iterator end() const
     { return m_entries.end(); }
 private:
+    //The entries with the same name are not usually together, so the index has the first one and how many there are
+    struct Slot
+    {
+        size_t first, count;
+    };
     std::string m_name;
     std::vector<IniEntry> m_entries;
+    std::unordered_map<std::string, Slot> m_index;
 
-    void add_line(const std::string &line);
+    void add_line(const std::string &line, int line_number);
+    void build_index();
 };
 
 class IniFile
 {
 public:
     IniFile(const std::string &fileName);
+    //The sections are pointed to by the index and by the users
+    IniFile(const IniFile&) =delete;
+    IniFile &operator=(const IniFile&) =delete;
     template<typename F>
     void preprocess_values(F filter)
     {
@@ -112,7 +129,7 @@ public:
     void Dump(std::ostream &os);
 
     const IniSection *find_single_section(const std::string &name) const;
-    std::vector<const IniSection*> find_multi_section(const std::string &name) const;
+    const std::vector<const IniSection*> &find_multi_section(const std::string &name) const;
 
     std::vector<IniSection>::const_iterator begin() const
     { return m_sections.begin(); }
@@ -120,6 +137,7 @@ public:
     { return m_sections.end(); }
 private:
     std::vector<IniSection> m_sections;
+    std::unordered_map<std::string, std::vector<const IniSection*>> m_index;
     void load(std::istream &is);
 };
 
@@ -22,95 +22,183 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 #include <sys/epoll.h>
 #include "inputdev.h"
 #include "event-codes.h"
+#include "stats.h"
 
 InputDevice::InputDevice(const IniSection &ini)
 {
     m_name = ini.find_single_value("name");
     if (m_name.empty())
         throw std::runtime_error("input without name");
+    m_stats.name = m_name;
 }
 
-InputDeviceEvent::InputDeviceEvent(const IniSection &ini, FD the_fd)
+InputDeviceEvent::InputDeviceEvent(const IniSection &ini, FD &&the_fd)
     :InputDevice(ini), m_fd(std::move(the_fd)), m_num_evs(0)
 {
-    bool grab = parse_bool(ini.find_single_value("grab"), false);
+    //on error the fd is given back to the caller, as it was
+    try
+    {
+        m_grab = parse_bool(ini.find_single_value("grab"), false);
+        setup();
 
-    if (grab)
-        test(ioctl(fd(), EVIOCGRAB, 1), "EVIOCGRAB");
+        char buf[1024] = "";
+        input_id iid;
+        if (ioctl(fd(), EVIOCGID, &iid) >= 0)
+            printf("    iid=%d %04x:%04x %d\n", iid.bustype, iid.vendor, iid.product, iid.version);
+        if (ioctl(fd(), EVIOCGNAME(sizeof(buf)), buf) >= 0)
+            printf("    name='%s'\n", buf);
+        if (ioctl(fd(), EVIOCGPHYS(sizeof(buf)), buf) >= 0)
+            printf("    phys='%s'\n", buf);
+        if (ioctl(fd(), EVIOCGUNIQ(sizeof(buf)), buf) >=0)
+            printf("    uniq='%s'\n", buf);
+        if (ioctl(fd(), EVIOCGPROP(sizeof(buf)), buf) >= 0)
+            printf("    prop='%s'\n", buf);
 
-    char buf[1024] = "";
-    input_id iid;
-    if (ioctl(fd(), EVIOCGID, &iid) >= 0)
-        printf("    iid=%d %04x:%04x %d\n", iid.bustype, iid.vendor, iid.product, iid.version);
-    if (ioctl(fd(), EVIOCGNAME(sizeof(buf)), buf) >= 0)
-        printf("    name='%s'\n", buf);
-    if (ioctl(fd(), EVIOCGPHYS(sizeof(buf)), buf) >= 0)
-        printf("    phys='%s'\n", buf);
-    if (ioctl(fd(), EVIOCGUNIQ(sizeof(buf)), buf) >=0)
-        printf("    uniq='%s'\n", buf);
-    if (ioctl(fd(), EVIOCGPROP(sizeof(buf)), buf) >= 0)
-        printf("    prop='%s'\n", buf);
-
-    test(ioctl(fd(), EVIOCGBIT(EV_REL, sizeof(buf)), buf), "EV_REL");
-    printf("    rel: ");
-    for (const auto &kv : g_rel_names)
-    {
-        if (!kv.name)
-            continue;
-        if (test_bit(kv.id, (unsigned char*)buf))
-            printf(" %s", kv.name);
-    }
-    printf("\n");
+        test(ioctl(fd(), EVIOCGBIT(EV_REL, sizeof(buf)), buf), "EV_REL");
+        printf("    rel: ");
+        for (const auto &kv : g_rel_names)
+        {
+            if (!kv.name)
+                continue;
+            if (test_bit(kv.id, (unsigned char*)buf))
+                printf(" %s", kv.name);
+        }
+        printf("\n");
 
-    test(ioctl(fd(), EVIOCGBIT(EV_ABS, sizeof(buf)), buf), "EV_ABS");
-    printf("    abs: ");
-    for (const auto &kv : g_abs_names)
-    {
-        if (!kv.name)
-            continue;
-        if (test_bit(kv.id, (unsigned char*)buf))
+        test(ioctl(fd(), EVIOCGBIT(EV_ABS, sizeof(buf)), buf), "EV_ABS");
+        printf("    abs: ");
+        for (const auto &kv : g_abs_names)
         {
-            printf(" %s", kv.name);
-            test(ioctl(fd(), EVIOCGABS(kv.id), &m_status.absinfo[kv.id]), "EVIOCGABS");
+            if (!kv.name)
+                continue;
+            if (test_bit(kv.id, (unsigned char*)buf))
+                printf(" %s", kv.name);
         }
+        printf("\n");
+
+        test(ioctl(fd(), EVIOCGBIT(EV_KEY, sizeof(buf)), buf), "EV_KEY");
+        printf("    key: ");
+        for (const auto &kv : g_key_names)
+        {
+            if (!kv.name)
+                continue;
+            if (test_bit(kv.id, (unsigned char*)buf))
+                printf(" %s", kv.name);
+        }
+        printf("\n");
     }
-    printf("\n");
+    catch (...)
+    {
+        if (m_grab)
+            ioctl(fd(), EVIOCGRAB, 0);
+        the_fd = std::move(m_fd);
+        throw;
+    }
+}
 
-    test(ioctl(fd(), EVIOCGBIT(EV_KEY, sizeof(buf)), buf), "EV_KEY");
-    printf("    key: ");
-    for (const auto &kv : g_key_names)
+//The per-device settings, for the first device and for the ones attached later
+void InputDeviceEvent::setup()
+{
+    if (m_grab)
+        test(ioctl(fd(), EVIOCGRAB, 1), "EVIOCGRAB");
+
+    //timestamp the events with the same clock we use to measure the latency
+    int clock_id = CLOCK_MONOTONIC;
+    test(ioctl(fd(), EVIOCSCLOCKID, &clock_id), "EVIOCSCLOCKID");
+
+    unsigned char bits[ABS_CNT / 8 + 1] = {};
+    test(ioctl(fd(), EVIOCGBIT(EV_ABS, sizeof(bits)), bits), "EV_ABS");
+    for (int i = 0; i < ABS_CNT; ++i)
     {
-        if (!kv.name)
-            continue;
-        if (test_bit(kv.id, (unsigned char*)buf))
-            printf(" %s", kv.name);
+        if (test_bit(i, bits))
+            test(ioctl(fd(), EVIOCGABS(i), &m_status.absinfo[i]), "EVIOCGABS");
     }
-    printf("\n");
 }
 
-ValueId InputDeviceEvent::parse_value(const std::string &name)
+void InputDeviceEvent::attach(FD fd)
 {
-    for (const auto &kv : g_key_names)
+    m_fd = std::move(fd);
+    m_num_evs = 0;
+    try
     {
-        if (kv.name && kv.name == name)
-            return ValueId(EV_KEY, kv.id);
+        setup();
+        for (auto &e : m_effects)
+        {
+            ff_effect ff = e.second.effect;
+            ff.id = -1;
+            e.second.device_id = ioctl(m_fd.get(), EVIOCSFF, &ff) < 0 ? -1 : ff.id;
+        }
     }
-    for (const auto &kv : g_rel_names)
+    catch (...)
     {
-        if (kv.name && kv.name == name)
-            return ValueId(EV_REL, kv.id);
+        m_fd.reset();
+        throw;
     }
-    for (const auto &kv : g_abs_names)
+}
+
+FD InputDeviceEvent::release()
+{
+    if (m_grab && m_fd)
+        ioctl(m_fd.get(), EVIOCGRAB, 0);
+    for (auto &e : m_effects)
     {
-        if (kv.name && kv.name == name)
-            return ValueId(EV_ABS, kv.id);
+        if (e.second.device_id >= 0)
+            ioctl(m_fd.get(), EVIOCRMFF, e.second.device_id);
     }
-    for (const auto &kv : g_ff_names)
+    FD fd = std::move(m_fd);
+    detach();
+    return fd;
+}
+
+//The value of an axis at rest: the minimum for triggers and pedals, the middle of the range for sticks and hats,
+//whatever their range is. ABS_Z and ABS_RZ are the triggers of some gamepads and the second stick of others,
+//the value they had when the device was opened tells which.
+static int rest_value(int code, const input_absinfo &ai)
+{
+    int middle = ai.minimum + (ai.maximum - ai.minimum) / 2;
+    switch (code)
     {
-        if (kv.name && kv.name == name)
-            return ValueId(EV_FF, kv.id);
+    case ABS_THROTTLE:
+    case ABS_GAS:
+    case ABS_BRAKE:
+    case ABS_PRESSURE:
+    case ABS_DISTANCE:
+    case ABS_MT_PRESSURE:
+        return ai.minimum;
+    case ABS_Z:
+    case ABS_RZ:
+        return ai.value - ai.minimum < middle - ai.value ? ai.minimum : middle;
+    default:
+        return middle;
     }
-    throw std::runtime_error("unknown value name " + name);
+}
+
+void InputDeviceEvent::detach()
+{
+    m_fd.reset();
+    m_num_evs = 0;
+    m_timestamp = 0;
+    //buttons released, sticks centered, triggers released
+    memset(m_status.key, 0, sizeof(m_status.key));
+    memset(m_status.rel, 0, sizeof(m_status.rel));
+    for (int i = 0; i < ABS_CNT; ++i)
+        m_status.abs[i] = rest_value(i, m_status.absinfo[i]);
+    for (auto &e : m_effects)
+        e.second.device_id = -1;
+}
+
+int InputDeviceEvent::effect_id(int id) const
+{
+    auto it = m_effects.find(id);
+    return it == m_effects.end() ? -1 : it->second.device_id;
+}
+
+ValueId InputDeviceEvent::parse_value(const std::string &name)
+{
+    const EventCode *ec = find_event_code(name);
+    if (!ec)
+        throw std::runtime_error("unknown value name " + name);
+    return ValueId(ec->type, ec->code);
 }
 
 PollResult InputDeviceEvent::on_poll(int event)
@@ -130,15 +218,31 @@ PollResult InputDeviceEvent::on_poll(int event)
         return PollResult::Error;
     }
 
-    m_num_evs += res / sizeof(input_event);
+    int num_read = res / sizeof(input_event);
+    m_stats.events += num_read;
+    m_num_evs += num_read;
     if (m_evs[m_num_evs - 1].type != EV_SYN)
     {
         printf("no EV_SYN, buffering\n");
         return PollResult::None;
     }
 
+    m_timestamp = event_time_ns(m_evs[0]);
+    int frames = 0;
     for (int i = 0; i < m_num_evs; ++i)
-        on_input(m_evs[i]);
+    {
+        input_event &ev = m_evs[i];
+        if (ev.type == EV_SYN)
+        {
+            if (ev.code == SYN_REPORT)
+                ++frames;
+            else if (ev.code == SYN_DROPPED)
+                ++m_stats.dropped;
+        }
+        on_input(ev);
+    }
+    if (frames > 1)
+        m_stats.merged += frames - 1;
     m_num_evs = 0;
     return PollResult::Sync;
 }
@@ -171,6 +275,20 @@ void InputDeviceEvent::on_input(input_event &ev)
     }
 }
 
+value_t abs_value(int value, const input_absinfo &ai)
+{
+#ifdef INPUTMAP_FIXED_POINT
+    //the raw values may not fit in the fixed point range
+    int64_t x = value;
+    int64_t max = ai.maximum, min = ai.minimum;
+    return Fixed::ratio(2 * (x - min), max - min) - 1;
+#else
+    value_t x = value;
+    value_t max = ai.maximum, min = ai.minimum;
+    return 1 + 2 * (x - max) / (max - min);
+#endif
+}
+
 value_t InputDeviceEvent::get_value(const ValueId &id)
 {
     switch (id.type)
@@ -180,34 +298,51 @@ value_t InputDeviceEvent::get_value(const ValueId &id)
     case EV_KEY:
         return m_status.key[id.code];
     case EV_ABS:
-        {
-            value_t x = m_status.abs[id.code];
-            value_t max = m_status.absinfo[id.code].maximum, min = m_status.absinfo[id.code].minimum;
-            return 1 + 2 * (x - max) / (max - min);
-        }
+        return abs_value(m_status.abs[id.code], m_status.absinfo[id.code]);
     default:
         return 0;
     }
 }
 
+bool InputDeviceEvent::get_raw_abs(int code, const input_absinfo &range, int &value)
+{
+    if (!attached())
+        return false;
+    const input_absinfo &ai = m_status.absinfo[code];
+    if (ai.minimum != range.minimum || ai.maximum != range.maximum)
+        return false;
+    value = m_status.abs[code];
+    return true;
+}
+
 void InputDeviceEvent::flush()
 {
     memset(m_status.rel, 0, sizeof(m_status.rel));
 }
 
-int InputDeviceEvent::ff_upload(const ff_effect &eff)
+int InputDeviceEvent::ff_upload(const ff_effect &eff, int id)
 {
+    if (!m_fd)
+        return -ENODEV;
     ff_effect ff = eff;
-    ff.id = -1;
+    //an update keeps the effect slot of the device
+    ff.id = effect_id(id);
     int res = ioctl(fd(), EVIOCSFF, &ff);
     if (res < 0)
         return -errno;
-    return ff.id;
+    if (m_effects.find(id) == m_effects.end())
+        id = m_next_effect_id++;
+    m_effects[id] = Effect{eff, ff.id};
+    return id;
 }
 
 int InputDeviceEvent::ff_erase(int id)
 {
-    int res = ioctl(fd(), EVIOCRMFF, id);
+    int device_id = effect_id(id);
+    m_effects.erase(id);
+    if (device_id < 0)
+        return 0;
+    int res = ioctl(fd(), EVIOCRMFF, device_id);
     if (res < 0)
         return -errno;
     return 0;
@@ -215,9 +350,12 @@ int InputDeviceEvent::ff_erase(int id)
 
 void InputDeviceEvent::ff_run(int eff, bool on)
 {
+    int device_id = effect_id(eff);
+    if (device_id < 0)
+        return;
     input_event ev{};
     ev.type = EV_FF;
-    ev.code = eff;
+    ev.code = device_id;
     ev.value = on? 1 : 0;
     test(write(fd(), &ev, sizeof(ev)), "write ff");
 }
@@ -23,9 +23,12 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 #define INPUTDEV_H_INCLUDED
 
 #include <memory>
+#include <map>
+#include <stdint.h>
 #include <linux/input.h>
 #include "steam/fd.h"
 #include "inifile.h"
+#include "stats.h"
 
 int bus_id(const char *bus_name);
 
@@ -75,9 +78,19 @@ struct IPollable
     virtual ~IPollable() {}
     virtual int fd() =0;
     virtual PollResult on_poll(int event) =0;
+    virtual DeviceStats *stats()
+    { return nullptr; }
 };
 
+#ifdef INPUTMAP_FIXED_POINT
+#include "fixed.h"
+typedef Fixed value_t;
+#else
 typedef float value_t;
+#endif
+
+//The value of an ABS axis from -1 to 1
+value_t abs_value(int value, const input_absinfo &ai);
 
 class InputDevice : public std::enable_shared_from_this<InputDevice>,
                     public IPollable
@@ -87,14 +100,35 @@ public:
     { return m_name; }
 
     virtual ValueId parse_value(const std::string &name) =0;
+    //Called for every value that an expression uses, also when it comes from the program cache
+    //and parse_value() is not called
+    virtual void use_value(const ValueId &id)
+    {}
     virtual value_t get_value(const ValueId &id) =0;
-    virtual int ff_upload(const ff_effect &eff) =0;
+    //Raw value of an ABS axis, only if its range is exactly that of `range`
+    virtual bool get_raw_abs(int code, const input_absinfo &range, int &value)
+    { return false; }
+    //id: the id returned by a previous upload, to update that effect, or -1 for a new one
+    virtual int ff_upload(const ff_effect &eff, int id) =0;
     virtual int ff_erase(int id) =0;
     virtual void ff_run(int eff, bool on) =0;
     virtual void flush() =0;
+    //Releases the device after an error, usually because it has been unplugged.
+    //The values go back to rest until a new device is attached.
+    virtual void detach() =0;
+    bool attached()
+    { return fd() >= 0; }
+
+    //Time of the oldest event of the last synced frame, CLOCK_MONOTONIC in ns
+    int64_t timestamp() const noexcept
+    { return m_timestamp; }
+    virtual DeviceStats *stats() override
+    { return &m_stats; }
 
 protected:
     InputDevice(const IniSection &ini);
+    int64_t m_timestamp = 0;
+    DeviceStats m_stats{"input"};
 private:
     std::string m_name;
 };
@@ -104,23 +138,41 @@ std::shared_ptr<InputDevice> InputDeviceEventCreate(const IniSection &ini, FD fd
 class InputDeviceEvent : public InputDevice
 {
 public:
-    explicit InputDeviceEvent(const IniSection &ini, FD fd);
+    //fd is only taken if it does not throw
+    InputDeviceEvent(const IniSection &ini, FD &&fd);
 
     virtual int fd()
     { return m_fd.get(); }
     virtual ValueId parse_value(const std::string &name);
     virtual PollResult on_poll(int event);
     virtual value_t get_value(const ValueId &id);
-    virtual int ff_upload(const ff_effect &eff);
+    virtual bool get_raw_abs(int code, const input_absinfo &range, int &value);
+    virtual int ff_upload(const ff_effect &eff, int id);
     virtual int ff_erase(int id);
     virtual void ff_run(int eff, bool on);
     virtual void flush();
+    virtual void detach();
+    //Takes over a device that matches this one, the uploaded effects are uploaded again
+    void attach(FD fd);
+    //Gives up the device without closing it, so that another InputDeviceEvent can attach it
+    FD release();
 private:
     FD m_fd;
     input_event m_evs[128];
     int m_num_evs;
     InputStatus m_status;
-
+    bool m_grab = false;
+    //Uploaded effects, with their current id in the device, so that they survive a new device being attached
+    struct Effect
+    {
+        ff_effect effect;
+        int device_id;
+    };
+    std::map<int, Effect> m_effects;
+    int m_next_effect_id = 0;
+
+    void setup();
+    int effect_id(int id) const;
     void on_input(input_event &ev);
 };
 
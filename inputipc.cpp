@@ -0,0 +1,291 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include <string.h>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "inputipc.h"
+#include "event-codes.h"
+
+//Same range as the output axes by default
+static const int g_ipc_abs_max = 32767;
+
+InputDeviceIpc::InputDeviceIpc(const IniSection &ini)
+    :InputDeviceIpc(ini, FD())
+{
+}
+
+InputDeviceIpc::InputDeviceIpc(const IniSection &ini, FD &&socket)
+    :InputDevice(ini), m_inode(0), m_shm{}, m_last_frame(0)
+{
+    m_path = ini.find_single_value("socket");
+    if (m_path.empty())
+        throw std::runtime_error("ipc input without socket: " + name());
+    m_shm_name = ini.find_single_value("shm_name");
+    for (auto &ai : m_status.absinfo)
+    {
+        ai = input_absinfo{};
+        ai.minimum = -g_ipc_abs_max;
+        ai.maximum = g_ipc_abs_max;
+    }
+
+    m_mode = ini.find_single_value("mode");
+
+    if (!socket)
+        socket = bind_socket();
+    try
+    {
+        attach(std::move(socket));
+    }
+    catch (...)
+    {
+        socket = std::move(m_fd);
+        throw;
+    }
+}
+
+InputDeviceIpc::~InputDeviceIpc()
+{
+    inputmap_shm_close(&m_shm);
+    unlink_socket();
+}
+
+FD InputDeviceIpc::bind_socket()
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (m_path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("socket path too long: " + m_path);
+    strcpy(addr.sun_path, m_path.c_str());
+    int fd = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    test(fd, "socket");
+    FD socket(fd);
+    unlink(m_path.c_str());
+    test(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), m_path.c_str());
+    //so that other users may send values
+    if (!m_mode.empty())
+        test(chmod(m_path.c_str(), strtoul(m_mode.c_str(), nullptr, 8)), m_path.c_str());
+    return socket;
+}
+
+void InputDeviceIpc::unlink_socket()
+{
+    struct stat st;
+    if (m_fd && stat(m_path.c_str(), &st) == 0 && st.st_ino == m_inode)
+        unlink(m_path.c_str());
+}
+
+void InputDeviceIpc::attach(FD socket)
+{
+    m_fd = std::move(socket);
+    struct stat st;
+    test(stat(m_path.c_str(), &st), m_path.c_str());
+    m_inode = st.st_ino;
+}
+
+FD InputDeviceIpc::release()
+{
+    m_status.reset();
+    return std::move(m_fd);
+}
+
+void InputDeviceIpc::reopen()
+{
+    attach(bind_socket());
+}
+
+ValueId InputDeviceIpc::parse_value(const std::string &name)
+{
+    const EventCode *ec = find_event_code(name);
+    if (!ec || (ec->type != EV_KEY && ec->type != EV_REL && ec->type != EV_ABS))
+        throw std::runtime_error("unknown value name " + name);
+    return ValueId(ec->type, ec->code);
+}
+
+PollResult InputDeviceIpc::on_poll(int event)
+{
+    if ((event & EPOLLIN) == 0)
+        return PollResult::None;
+
+    int frames = 0;
+    bool doorbell = false;
+    inputmap_ipc_event evs[64];
+    for (;;)
+    {
+        ssize_t res = recv(fd(), evs, sizeof(evs), MSG_DONTWAIT);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            perror("ipc recv");
+            return PollResult::Error;
+        }
+        if (!m_shm_name.empty())
+        {
+            doorbell = true;
+            continue;
+        }
+        int num = res / sizeof(inputmap_ipc_event);
+        m_stats.events += num;
+        for (int i = 0; i < num; ++i)
+        {
+            if (evs[i].type == EV_SYN && evs[i].code == SYN_REPORT)
+                ++frames;
+            else
+                on_input(evs[i]);
+        }
+    }
+    if (doorbell)
+        return read_frames() ? PollResult::Sync : PollResult::None;
+    if (frames == 0)
+        return PollResult::None;
+    m_timestamp = now_ns();
+    if (frames > 1)
+        m_stats.merged += frames - 1;
+    return PollResult::Sync;
+}
+
+//All the frames since the last one read are applied, the relative values are added up
+bool InputDeviceIpc::read_frames()
+{
+    if (m_shm.header && inputmap_shm_closed(&m_shm))
+        inputmap_shm_close(&m_shm);
+    if (!m_shm.header)
+    {
+        //the other program may have created it after us, or a new one
+        int err = inputmap_shm_open(m_shm_name.c_str(), &m_shm);
+        if (err < 0)
+        {
+            fprintf(stderr, "%s: %s: %s\n", name().c_str(), m_shm_name.c_str(), strerror(-err));
+            return false;
+        }
+        m_last_frame = 0;
+    }
+
+    //only the layout checked when opening it, the header may be changed by the other program at any time
+    const inputmap_shm_code *codes = inputmap_shm_codes(m_shm.header);
+    uint32_t num_frames = m_shm.num_frames, num_values = m_shm.num_values;
+    m_values.resize(num_values);
+    uint64_t head = inputmap_shm_head(&m_shm);
+    uint64_t first = m_last_frame + 1;
+    //the frames older than a full ring have been overwritten already
+    if (head >= num_frames && first < head - num_frames + 1)
+    {
+        m_stats.dropped += head - num_frames + 1 - first;
+        first = head - num_frames + 1;
+    }
+    int frames = 0;
+    for (uint64_t n = first; n <= head; ++n)
+    {
+        int64_t time_ns;
+        int err = inputmap_shm_read(&m_shm, n, &time_ns, m_values.data());
+        if (err == -EAGAIN)
+            break;
+        m_last_frame = n;
+        if (err < 0)
+        {
+            //overwritten while reading it
+            ++m_stats.dropped;
+            continue;
+        }
+        if (frames++ == 0)
+            m_timestamp = time_ns;
+        for (uint32_t i = 0; i < num_values; ++i)
+            on_input(inputmap_ipc_event{codes[i].type, codes[i].code, m_values[i]});
+        m_stats.events += num_values;
+    }
+    if (frames > 1)
+        m_stats.merged += frames - 1;
+    return frames > 0;
+}
+
+void InputDeviceIpc::on_input(const inputmap_ipc_event &ev)
+{
+    switch (ev.type)
+    {
+    case EV_ABS:
+        if (ev.code < ABS_CNT)
+            m_status.abs[ev.code] = ev.value;
+        break;
+    case EV_REL:
+        if (ev.code < REL_CNT)
+            m_status.rel[ev.code] += ev.value;
+        break;
+    case EV_KEY:
+        if (ev.code < KEY_CNT)
+            m_status.key[ev.code] = ev.value;
+        break;
+    }
+}
+
+value_t InputDeviceIpc::get_value(const ValueId &id)
+{
+    switch (id.type)
+    {
+    case EV_REL:
+        return m_status.rel[id.code];
+    case EV_KEY:
+        return m_status.key[id.code];
+    case EV_ABS:
+        return abs_value(m_status.abs[id.code], m_status.absinfo[id.code]);
+    default:
+        return 0;
+    }
+}
+
+bool InputDeviceIpc::get_raw_abs(int code, const input_absinfo &range, int &value)
+{
+    const input_absinfo &ai = m_status.absinfo[code];
+    if (ai.minimum != range.minimum || ai.maximum != range.maximum)
+        return false;
+    value = m_status.abs[code];
+    return true;
+}
+
+int InputDeviceIpc::ff_upload(const ff_effect &eff, int id)
+{
+    return -EINVAL;
+}
+int InputDeviceIpc::ff_erase(int id)
+{
+    return -EINVAL;
+}
+void InputDeviceIpc::ff_run(int eff, bool on)
+{
+}
+
+void InputDeviceIpc::flush()
+{
+    memset(m_status.rel, 0, sizeof(m_status.rel));
+}
+
+void InputDeviceIpc::detach()
+{
+    m_status.reset();
+    unlink_socket();
+    m_fd.reset();
+}
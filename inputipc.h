@@ -0,0 +1,74 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef INPUTIPC_H_INCLUDED
+#define INPUTIPC_H_INCLUDED
+
+#include "inifile.h"
+#include "inputdev.h"
+#include "inputmap-shm.h"
+
+//Values sent by other programs to a Unix datagram socket, or written to a shared memory ring, see inputmap-shm.h
+class InputDeviceIpc : public InputDevice
+{
+public:
+    explicit InputDeviceIpc(const IniSection &ini);
+    //Takes the socket of another InputDeviceIpc with the same socket path, only if it does not throw
+    InputDeviceIpc(const IniSection &ini, FD &&socket);
+    ~InputDeviceIpc();
+
+    virtual int fd()
+    { return m_fd.get(); }
+    virtual ValueId parse_value(const std::string &name);
+    virtual PollResult on_poll(int event);
+    virtual value_t get_value(const ValueId &id);
+    virtual bool get_raw_abs(int code, const input_absinfo &range, int &value);
+    virtual int ff_upload(const ff_effect &eff, int id);
+    virtual int ff_erase(int id);
+    virtual void ff_run(int eff, bool on);
+    virtual void flush();
+    virtual void detach();
+    void attach(FD socket);
+    //Creates the socket again after detach(), the other programs see it as a new one
+    void reopen();
+    //Gives up the socket without removing it, so that another InputDeviceIpc can attach it
+    FD release();
+    const std::string &socket_path() const
+    { return m_path; }
+
+private:
+    std::string m_path, m_mode, m_shm_name;
+    FD m_fd;
+    //to remove the socket file only if it is still ours
+    ino_t m_inode;
+    InputStatus m_status;
+    inputmap_shm m_shm;
+    uint64_t m_last_frame;
+    std::vector<int32_t> m_values;
+
+    FD bind_socket();
+    void unlink_socket();
+    void on_input(const inputmap_ipc_event &ev);
+    bool read_frames();
+};
+
+#endif /* INPUTIPC_H_INCLUDED */
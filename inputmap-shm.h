@@ -0,0 +1,256 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef INPUTMAP_SHM_H_INCLUDED
+#define INPUTMAP_SHM_H_INCLUDED
+
+/* Layout of the shared memory segment of an [output] section with sink=shm, and a reader for it.
+ * It is plain C, so that it can be used from any program.
+ *
+ * The segment starts with an inputmap_shm_header, followed by the type and code of each value
+ * (inputmap_shm_code), and then a ring of num_frames frames, starting at frames_offset.
+ * Every synced frame of the output has the current value of all its values, in the same order as the codes,
+ * and the delta of the frame for the EV_REL values. The frame number N (counting from 1) is in slot
+ * (N - 1) % num_frames, and it is protected by a seqlock: its seq is odd while it is being written.
+ *
+ * There is a single writer, and any number of readers that do not write to the segment at all.
+ *
+ * The same layout is used in the other direction by [ipc] input sections with a shm_name: the other program
+ * creates the segment and writes the frames, and sends a datagram to the socket of the section after each one.
+ * Without a shm_name, the datagrams themselves have the values, as an array of inputmap_ipc_event, and
+ * an EV_SYN/SYN_REPORT event ends each frame.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INPUTMAP_SHM_MAGIC 0x48534d49u /* "IMSH" */
+#define INPUTMAP_SHM_VERSION 1
+
+struct inputmap_shm_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t closed;        /* the writer is gone, open the segment again by name */
+    uint32_t num_frames;    /* a power of 2 */
+    uint32_t num_values;
+    uint32_t frame_size;    /* in bytes */
+    uint32_t frames_offset; /* in bytes, from the start of the segment */
+    uint32_t reserved;
+    uint64_t head;          /* number of the last published frame, 0 if none */
+};
+
+struct inputmap_shm_code
+{
+    uint16_t type;
+    uint16_t code;
+};
+
+struct inputmap_shm_frame
+{
+    uint32_t seq;
+    uint32_t reserved;
+    uint64_t number;
+    int64_t time_ns;        /* CLOCK_MONOTONIC time of the input event that caused this frame */
+    /* followed by num_values int32_t */
+};
+
+static inline const struct inputmap_shm_code *inputmap_shm_codes(const struct inputmap_shm_header *h)
+{
+    return (const struct inputmap_shm_code *)(h + 1);
+}
+
+static inline struct inputmap_shm_frame *inputmap_shm_slot(const struct inputmap_shm_header *h, uint64_t number)
+{
+    uint64_t slot = (number - 1) & (h->num_frames - 1);
+    return (struct inputmap_shm_frame *)((char *)h + h->frames_offset + slot * h->frame_size);
+}
+
+static inline int32_t *inputmap_shm_values(struct inputmap_shm_frame *f)
+{
+    return (int32_t *)(f + 1);
+}
+
+/* Writer */
+
+static inline size_t inputmap_shm_frames_offset(uint32_t num_values)
+{
+    size_t x = sizeof(struct inputmap_shm_header) + num_values * sizeof(struct inputmap_shm_code);
+    return (x + 63) / 64 * 64;
+}
+
+static inline size_t inputmap_shm_frame_size(uint32_t num_values)
+{
+    size_t x = sizeof(struct inputmap_shm_frame) + num_values * sizeof(int32_t);
+    return (x + 63) / 64 * 64;
+}
+
+/* Size of the segment, num_frames must be a power of 2 */
+static inline size_t inputmap_shm_size(uint32_t num_frames, uint32_t num_values)
+{
+    return inputmap_shm_frames_offset(num_values) + num_frames * inputmap_shm_frame_size(num_values);
+}
+
+/* mem is a zeroed segment of inputmap_shm_size() bytes */
+static inline struct inputmap_shm_header *inputmap_shm_init(void *mem, uint32_t num_frames,
+        const struct inputmap_shm_code *codes, uint32_t num_values)
+{
+    struct inputmap_shm_header *h = (struct inputmap_shm_header *)mem;
+    h->num_frames = num_frames;
+    h->num_values = num_values;
+    h->frame_size = inputmap_shm_frame_size(num_values);
+    h->frames_offset = inputmap_shm_frames_offset(num_values);
+    memcpy(h + 1, codes, num_values * sizeof(struct inputmap_shm_code));
+    h->version = INPUTMAP_SHM_VERSION;
+    __atomic_store_n(&h->magic, INPUTMAP_SHM_MAGIC, __ATOMIC_RELEASE);
+    return h;
+}
+
+static inline void inputmap_shm_publish(struct inputmap_shm_header *h, int64_t time_ns, const int32_t *values)
+{
+    uint64_t number = h->head + 1;
+    struct inputmap_shm_frame *f = inputmap_shm_slot(h, number);
+    uint32_t seq = f->seq;
+
+    __atomic_store_n(&f->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    f->number = number;
+    f->time_ns = time_ns;
+    memcpy(inputmap_shm_values(f), values, h->num_values * sizeof(int32_t));
+    __atomic_store_n(&f->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->head, number, __ATOMIC_RELEASE);
+}
+
+/* Reader */
+
+struct inputmap_shm
+{
+    const struct inputmap_shm_header *header;
+    size_t size;
+    /* The layout, copied and checked by inputmap_shm_open(). The reader never uses those of the header again,
+     * so a writer that changes them later cannot make it read out of the segment. */
+    uint32_t num_frames;
+    uint32_t num_values;
+    uint32_t frame_size;
+    uint32_t frames_offset;
+};
+
+/* name is the shm_name of the [output] section. Returns 0 or -errno */
+static inline int inputmap_shm_open(const char *name, struct inputmap_shm *shm)
+{
+    struct stat st;
+    void *p;
+    const struct inputmap_shm_header *h;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct inputmap_shm_header))
+    {
+        close(fd);
+        return -EINVAL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -errno;
+    h = (const struct inputmap_shm_header *)p;
+    shm->header = h;
+    shm->size = st.st_size;
+    shm->num_frames = __atomic_load_n(&h->num_frames, __ATOMIC_RELAXED);
+    shm->num_values = __atomic_load_n(&h->num_values, __ATOMIC_RELAXED);
+    shm->frame_size = __atomic_load_n(&h->frame_size, __ATOMIC_RELAXED);
+    shm->frames_offset = __atomic_load_n(&h->frames_offset, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != INPUTMAP_SHM_MAGIC || h->version != INPUTMAP_SHM_VERSION ||
+            shm->num_frames == 0 || (shm->num_frames & (shm->num_frames - 1)) != 0 ||
+            shm->frame_size < inputmap_shm_frame_size(shm->num_values) ||
+            shm->frames_offset < inputmap_shm_frames_offset(shm->num_values) ||
+            shm->frames_offset + (uint64_t)shm->num_frames * shm->frame_size > shm->size)
+    {
+        munmap(p, st.st_size);
+        shm->header = NULL;
+        return -EPROTO;
+    }
+    return 0;
+}
+
+static inline void inputmap_shm_close(struct inputmap_shm *shm)
+{
+    if (shm->header)
+        munmap((void *)shm->header, shm->size);
+    shm->header = NULL;
+}
+
+static inline int inputmap_shm_closed(const struct inputmap_shm *shm)
+{
+    return __atomic_load_n(&shm->header->closed, __ATOMIC_ACQUIRE) != 0;
+}
+
+static inline uint64_t inputmap_shm_head(const struct inputmap_shm *shm)
+{
+    return __atomic_load_n(&shm->header->head, __ATOMIC_ACQUIRE);
+}
+
+/* The slot of a frame, with the layout checked by inputmap_shm_open() */
+static inline const struct inputmap_shm_frame *inputmap_shm_read_slot(const struct inputmap_shm *shm, uint64_t number)
+{
+    uint64_t slot = (number - 1) & (shm->num_frames - 1);
+    return (const struct inputmap_shm_frame *)((const char *)shm->header + shm->frames_offset + slot * shm->frame_size);
+}
+
+/* Copies the frame `number` into time_ns and values (shm->num_values of them).
+ * Returns 0, -EAGAIN if the frame is not published yet, or -ERANGE if it has been overwritten
+ * while or before reading it (skip to the head). */
+static inline int inputmap_shm_read(const struct inputmap_shm *shm, uint64_t number, int64_t *time_ns, int32_t *values)
+{
+    const struct inputmap_shm_frame *f = inputmap_shm_read_slot(shm, number);
+    uint32_t s1, s2;
+    uint64_t n;
+
+    if (number == 0 || number > inputmap_shm_head(shm))
+        return -EAGAIN;
+    s1 = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+    n = f->number;
+    *time_ns = f->time_ns;
+    memcpy(values, (const int32_t *)(f + 1), shm->num_values * sizeof(int32_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    s2 = __atomic_load_n(&f->seq, __ATOMIC_RELAXED);
+    /* the frame was published, so any change means that a newer frame is taking its slot */
+    if ((s1 & 1) || s1 != s2 || n != number)
+        return -ERANGE;
+    return 0;
+}
+
+/* Datagrams of the [ipc] input sections without shm_name */
+
+struct inputmap_ipc_event
+{
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+};
+
+#endif /* INPUTMAP_SHM_H_INCLUDED */
@@ -25,7 +25,9 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 #include <fstream>
 #include <list>
 #include <map>
+#include <set>
 #include <algorithm>
+#include <functional>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,7 +38,12 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "inifile.h"
 #include "inputsteam.h"
+#include "inputipc.h"
 #include "outputdev.h"
+#include "statsserver.h"
+#include "devcache.h"
+#include "hotplug.h"
+#include "progcache.h"
 #include "steam/udev-wrapper.h"
 #include "steam/fd.h"
 #include "steam/steamcontroller.h"
@@ -45,6 +52,7 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 bool g_verbose = false;
 bool g_daemonize = false;
 const char *g_writepid;
+const char *g_stats_socket;
 
 void help(const char *name)
 {
@@ -53,11 +61,13 @@ void help(const char *name)
     printf("\t-v: Verbose output.\n");
     printf("\t-d: Run in background (daemonize) when all output devices have been created.\n");
     printf("\t-p <filename>: Write the PID into the given file. Useful to kill the program later.\n");
-    printf("\t-m <key>=<value>: Define a macro to be replaced in the ini file: {<key>} will be replaced with <value>.\n");
+    printf("\t-m <key>=<value>: Define a macro to be replaced in the ini file: {<key>} will be replaced with <value>, {<key>:<default>} with <default> if not defined.\n");
+    printf("\t-s <socket>: Report the runtime statistics to anyone connecting to this Unix socket.\n");
     exit(EXIT_FAILURE);
 }
 
 volatile bool g_exit = false;
+volatile bool g_reload = false;
 
 template<typename IT>
 class InputFinder : public IInputByName
@@ -138,12 +148,125 @@ int bus_id(const char *bus_name)
 
 struct FoundInputDevice
 {
-    FD fd;
+    FD fd;  //null if not opened yet, the identity may come from the cache
+    bool used = false;
     std::string dev, name, uniq;
     input_id iid;
 };
 
-std::vector<FoundInputDevice> list_input_devices()
+//Opens the device, only once
+FD take_input_device(FoundInputDevice &fid)
+{
+    if (fid.used)
+        return FD();
+    fid.used = true;
+    if (fid.fd)
+        return std::move(fid.fd);
+    return FD_open(fid.dev.c_str(), O_RDONLY);
+}
+
+void print_input_device(const FoundInputDevice &fid)
+{
+    std::string extra;
+    if (!fid.uniq.empty())
+        extra = " : <" + fid.uniq + ">";
+    printf("%04x:%04x %5s %s '%s'%s\n", fid.iid.vendor, fid.iid.product, bus_name(fid.iid.bustype), fid.dev.c_str(), fid.name.c_str(), extra.c_str());
+}
+
+static std::string unquote(const char *s)
+{
+    if (!s)
+        return std::string();
+    std::string res = s;
+    if (res.size() >= 2 && res.front() == '"' && res.back() == '"')
+        res = res.substr(1, res.size() - 2);
+    return trim(res);
+}
+
+//Gets the identity of an event device from the udev properties of its parent inputN device, without opening it.
+//Returns false if they are not available.
+bool identify_input_device_udev(udev_device *dx, FoundInputDevice &fid)
+{
+    udev_device *parent = udev_device_get_parent_with_subsystem_devtype(dx, "input", nullptr);
+    if (!parent)
+        return false;
+    //PRODUCT is "bus/vendor/product/version", in hex. Unlike ID_VENDOR_ID/ID_MODEL_ID, it is there for every bus
+    const char *product = udev_device_get_property_value(parent, "PRODUCT");
+    unsigned bustype, vendor, prod, version;
+    if (!product || sscanf(product, "%x/%x/%x/%x", &bustype, &vendor, &prod, &version) != 4)
+        return false;
+    fid.iid.bustype = bustype;
+    fid.iid.vendor = vendor;
+    fid.iid.product = prod;
+    fid.iid.version = version;
+    fid.name = unquote(udev_device_get_property_value(parent, "NAME"));
+    fid.uniq = unquote(udev_device_get_property_value(parent, "UNIQ"));
+    return true;
+}
+
+//Gets the identity of an event device from udev, or from the cache, or by opening it, in that order.
+bool identify_input_device(udev_device *dx, DeviceCache &cache, FoundInputDevice &fid)
+{
+    const char *syspath = udev_device_get_syspath(dx);
+    const char *dev = udev_device_get_devnode(dx);
+    const char *sysname = udev_device_get_sysname(dx);
+    if (!dev || !sysname || strncmp(sysname, "event", 5) != 0)
+        return false;
+    fid.dev = dev;
+
+    if (identify_input_device_udev(dx, fid))
+        return true;
+
+    uint64_t usec = udev_device_usec_initialized(dx);
+    if (const DeviceCacheRecord *rec = cache.find(syspath, usec))
+    {
+        fid.iid.bustype = rec->bustype;
+        fid.iid.vendor = rec->vendor;
+        fid.iid.product = rec->product;
+        fid.iid.version = rec->version;
+        fid.name = rec->name;
+        fid.uniq = rec->uniq;
+        return true;
+    }
+
+    FD fd { open(dev, O_RDONLY) };
+    if (!fd)
+    {
+        if (g_verbose)
+            fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+        return false;
+    }
+
+    if (ioctl(fd.get(), EVIOCGID, &fid.iid) < 0)
+    {
+        if (g_verbose)
+            fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+        return false;
+    }
+
+    char buf[1024];
+    //do not fail if the device has no name
+    if (ioctl(fd.get(), EVIOCGNAME(sizeof(buf)), buf) >= 0)
+        fid.name = trim(buf);
+    if (ioctl(fd.get(), EVIOCGUNIQ(sizeof(buf)), buf) >= 0)
+        fid.uniq = trim(buf);
+
+    DeviceCacheRecord rec = {};
+    DeviceCache::set_string(rec.syspath, syspath);
+    rec.usec_initialized = usec;
+    rec.bustype = fid.iid.bustype;
+    rec.vendor = fid.iid.vendor;
+    rec.product = fid.iid.product;
+    rec.version = fid.iid.version;
+    DeviceCache::set_string(rec.name, fid.name);
+    DeviceCache::set_string(rec.uniq, fid.uniq);
+    cache.add(rec);
+
+    fid.fd = std::move(fd);
+    return true;
+}
+
+std::vector<FoundInputDevice> list_input_devices(DeviceCache &cache)
 {
     std::vector<FoundInputDevice> res;
     udev_ptr ud { udev_new() };
@@ -153,63 +276,42 @@ std::vector<FoundInputDevice> list_input_devices()
     for (auto udev : udevs)
     {
         udev_device_ptr dx { udev_device_new_from_syspath(ud.get(), udev.c_str()) };
-        const char *dev = udev_device_get_devnode(dx.get());
-
-        if (!dev)
-            continue;
-        auto slash = udev.rfind('/');
-        if (slash == std::string::npos)
-            continue;
-        if (udev.substr(slash + 1, 5) != "event")
+        if (!dx)
             continue;
-
-        FD fd { open(dev, O_RDONLY) };
-        if (!fd)
-        {
-            if (g_verbose)
-                fprintf(stderr, "%s: %s\n", dev, strerror(errno));
-            continue;
-        }
-
         FoundInputDevice fid;
-        fid.dev = dev;
-        if (ioctl(fd.get(), EVIOCGID, &fid.iid) < 0)
-        {
-            if (g_verbose)
-                fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+        if (!identify_input_device(dx.get(), cache, fid))
             continue;
-        }
-
-        char buf[1024];
-        //do not fail if the device has no name
-        if (ioctl(fd.get(), EVIOCGNAME(sizeof(buf)), buf) >= 0)
-            fid.name = trim(buf);
-        if (ioctl(fd.get(), EVIOCGUNIQ(sizeof(buf)), buf) >= 0)
-            fid.uniq = trim(buf);
-
         if (g_verbose)
-        {
-            std::string extra;
-            if (!fid.uniq.empty())
-                extra = " : <" + fid.uniq + ">";
-            printf("%04x:%04x %5s %s '%s'%s\n", fid.iid.vendor, fid.iid.product, bus_name(fid.iid.bustype), dev, fid.name.c_str(), extra.c_str());
-        }
-        fid.fd = std::move(fd);
+            print_input_device(fid);
         res.push_back(std::move(fid));
     }
     return res;
 }
 
-FoundInputDevice *find_input_device(std::vector<FoundInputDevice> &fids, int bus, const std::string &vp)
+//Sections with dev, by-id or by-path do not need the list of devices
+bool needs_input_device_list(const IniSection *s)
+{
+    return s->find_single_value("dev").empty() &&
+        s->find_single_value("by-id").empty() &&
+        s->find_single_value("by-path").empty();
+}
+
+static void parse_vendor_product(const std::string &vp, int &vendor, int &product)
 {
     auto colon = vp.find(':');
     if (colon == std::string::npos)
         throw std::runtime_error("invalid vendor:product pair: " + vp);
 
-    int vendor = parse_hex_int(vp.substr(0, colon), -1);
-    int product = parse_hex_int(vp.substr(colon + 1), -1);
+    vendor = parse_hex_int(vp.substr(0, colon), -1);
+    product = parse_hex_int(vp.substr(colon + 1), -1);
     if (vendor == -1 || product == -1)
         throw std::runtime_error("invalid vendor:product pair: " + vp);
+}
+
+FoundInputDevice *find_input_device(std::vector<FoundInputDevice> &fids, int bus, const std::string &vp)
+{
+    int vendor, product;
+    parse_vendor_product(vp, vendor, product);
 
     for (auto &fid: fids)
     {
@@ -219,6 +321,55 @@ FoundInputDevice *find_input_device(std::vector<FoundInputDevice> &fids, int bus
     throw std::runtime_error("device " + vp + " not found");
 }
 
+static bool has_devnode(udev_device *dx, const std::string &path)
+{
+    const char *devnode = udev_device_get_devnode(dx);
+    if (devnode && path == devnode)
+        return true;
+    for (udev_list_entry *le = udev_device_get_devlinks_list_entry(dx); le; le = udev_list_entry_get_next(le))
+    {
+        if (path == udev_list_entry_get_name(le))
+            return true;
+    }
+    return false;
+}
+
+//Whether a device that has just been plugged matches the section, with the same criteria as find_input_device_from_section()
+bool input_device_matches(const IniSection *s, udev_device *dx, const FoundInputDevice &fid)
+{
+    std::string sdev = s->find_single_value("dev");
+    if (!sdev.empty())
+        return has_devnode(dx, sdev);
+
+    std::string sbyid = s->find_single_value("by-id");
+    if (!sbyid.empty())
+        return has_devnode(dx, "/dev/input/by-id/" + sbyid);
+
+    std::string sbypath = s->find_single_value("by-path");
+    if (!sbypath.empty())
+        return has_devnode(dx, "/dev/input/by-path/" + sbypath);
+
+    std::string sbyuniq = s->find_single_value("by-uniq");
+    if (!sbyuniq.empty())
+        return fid.uniq == sbyuniq;
+
+    std::string sbyname = s->find_single_value("by-name");
+    if (!sbyname.empty())
+        return fid.name == sbyname;
+
+    for (const auto &bus : g_buses)
+    {
+        std::string sbus = s->find_single_value(bus.name);
+        if (!sbus.empty())
+        {
+            int vendor, product;
+            parse_vendor_product(sbus, vendor, product);
+            return bus.id == fid.iid.bustype && vendor == fid.iid.vendor && product == fid.iid.product;
+        }
+    }
+    return false;
+}
+
 FD find_input_device_from_section(std::vector<FoundInputDevice> &fids, const IniSection *s)
 {
     std::string sdev = s->find_single_value("dev");
@@ -239,7 +390,7 @@ FD find_input_device_from_section(std::vector<FoundInputDevice> &fids, const Ini
         for (auto &fid: fids)
         {
             if (fid.uniq == sbyuniq)
-                return std::move(fid.fd);
+                return take_input_device(fid);
         }
         throw std::runtime_error("uniq device '" + sbyuniq + "' not found");
     }
@@ -250,7 +401,7 @@ FD find_input_device_from_section(std::vector<FoundInputDevice> &fids, const Ini
         for (auto &fid: fids)
         {
             if (fid.name == sbyname)
-                return std::move(fid.fd);
+                return take_input_device(fid);
         }
         throw std::runtime_error("name device '" + sbyname + "' not found");
     }
@@ -261,18 +412,341 @@ FD find_input_device_from_section(std::vector<FoundInputDevice> &fids, const Ini
         if (!sbus.empty())
         {
             FoundInputDevice *fid = find_input_device(fids, bus.id, sbus);
-            return std::move(fid->fd);
+            return take_input_device(*fid);
         }
     }
 
     throw std::runtime_error("input section without device: " + s->name());
 }
 
+//Everything that is built from the configuration file, so that it can be built again on SIGHUP
+struct Config
+{
+    explicit Config(const std::string &file)
+        :ini(file)
+    {}
+    IniFile ini;
+    std::list<std::shared_ptr<InputDevice>> inputs;
+    //The section of each input, to match the devices plugged later and to compare with a new configuration
+    std::map<InputDevice*, const IniSection*> sections;
+    std::map<std::string, Variable> variables;
+    std::list<OutputDevice> outputs;
+
+    std::shared_ptr<InputDevice> find_input(const std::string &name)
+    {
+        for (auto &input : inputs)
+        {
+            if (input->name() == name)
+                return input;
+        }
+        return nullptr;
+    }
+};
+
+//Replaces every {name} with the value given with -m, or {name:default} with the default if it is not given.
+//Each value is scanned once into a buffer that is reused for all of them.
+void expand_macros(IniFile &ini, const std::map<std::string, std::string> &defines)
+{
+    std::string buf, name;
+    std::set<std::string> warned;
+    ini.preprocess_values([&](std::string &v, int line)
+    {
+        size_t start = v.find('{');
+        if (start == std::string::npos)
+            return;
+        buf.assign(v, 0, start);
+        while (start != std::string::npos)
+        {
+            size_t end = v.find('}', start + 1);
+            if (end == std::string::npos)
+            {
+                buf.append(v, start, std::string::npos);
+                break;
+            }
+            size_t colon = v.find(':', start + 1);
+            bool has_default = colon < end;
+            name.assign(v, start + 1, (has_default ? colon : end) - start - 1);
+            auto it = defines.find(name);
+            if (it != defines.end())
+            {
+                buf += it->second;
+            }
+            else if (has_default)
+            {
+                buf.append(v, colon + 1, end - colon - 1);
+            }
+            else
+            {
+                if (warned.insert(name).second)
+                    fprintf(stderr, "Warning: macro '%s' used but not defined, line %d\n", name.c_str(), line);
+                buf.append(v, start, end - start + 1);
+            }
+            start = v.find('{', end + 1);
+            buf.append(v, end + 1, (start == std::string::npos ? v.size() : start) - end - 1);
+        }
+        v.swap(buf);
+    });
+}
+
+static bool same_section(const IniSection &a, const IniSection &b)
+{
+    auto ia = a.begin(), ib = b.begin();
+    for (; ia != a.end() && ib != b.end(); ++ia, ++ib)
+    {
+        if (ia->name() != ib->name() || ia->value() != ib->value())
+            return false;
+    }
+    return ia == a.end() && ib == b.end();
+}
+
+//Whether both [input] sections would look for the same device
+static bool same_device_criteria(const IniSection &a, const IniSection &b)
+{
+    for (const char *key : {"dev", "by-id", "by-path", "by-uniq", "by-name"})
+    {
+        if (a.find_single_value(key) != b.find_single_value(key))
+            return false;
+    }
+    for (const auto &bus : g_buses)
+    {
+        if (a.find_single_value(bus.name) != b.find_single_value(bus.name))
+            return false;
+    }
+    return true;
+}
+
+//Builds the inputs, variables and outputs of the configuration file.
+//With a previous configuration, the inputs with the same section are shared, the inputs with the same name
+//take over the device of the old one, and the outputs with the same uinput device take it over. If anything
+//fails, the previous configuration is left as it was.
+std::unique_ptr<Config> build_config(const std::string &file, const std::map<std::string, std::string> &defines,
+        DeviceCache &devcache, Config *previous)
+{
+    std::unique_ptr<Config> cfg(new Config(file));
+    expand_macros(cfg->ini, defines);
+    //ini.Dump(std::cout);
+
+    //The expressions compiled the last time this same configuration was used
+    ProgramCache progcache(ProgramCache::make_key(file, defines));
+
+    //Devices handed over by the previous configuration, to give them back if anything fails
+    std::vector<std::function<void ()>> undo;
+    try
+    {
+        SteamController::SetSerialCache(&devcache);
+        set_program_cache(&progcache);
+        std::vector<FoundInputDevice> fids;
+        bool fids_listed = false;
+
+        for (auto &s : cfg->ini.find_multi_section("steam"))
+        {
+            auto old = previous ? std::dynamic_pointer_cast<InputDeviceSteam>(previous->find_input(s->find_single_value("name"))) : nullptr;
+            std::shared_ptr<InputDevice> dev;
+            if (old && same_section(*previous->sections[old.get()], *s))
+            {
+                dev = old;
+            }
+            else if (old && old->attached())
+            {
+                //if the new one fails the old one gets its controller back
+                SteamController controller = old->release();
+                std::shared_ptr<InputDeviceSteam> steam;
+                try
+                {
+                    steam = std::make_shared<InputDeviceSteam>(*s, std::move(controller));
+                }
+                catch (...)
+                {
+                    old->attach(std::move(controller));
+                    throw;
+                }
+                undo.push_back([old, steam] { old->attach(steam->release()); });
+                dev = steam;
+            }
+            else
+            {
+                dev = std::make_shared<InputDeviceSteam>(*s);
+            }
+            cfg->inputs.push_back(dev);
+            cfg->sections[dev.get()] = s;
+        }
+        for (auto &s : cfg->ini.find_multi_section("ipc"))
+        {
+            auto old = previous ? std::dynamic_pointer_cast<InputDeviceIpc>(previous->find_input(s->find_single_value("name"))) : nullptr;
+            std::shared_ptr<InputDevice> dev;
+            if (old && same_section(*previous->sections[old.get()], *s))
+            {
+                dev = old;
+            }
+            else if (old && old->attached() && old->socket_path() == s->find_single_value("socket"))
+            {
+                //the other programs keep sending to the same socket
+                FD socket = old->release();
+                std::shared_ptr<InputDeviceIpc> ipc;
+                try
+                {
+                    ipc = std::make_shared<InputDeviceIpc>(*s, std::move(socket));
+                }
+                catch (...)
+                {
+                    old->attach(std::move(socket));
+                    throw;
+                }
+                undo.push_back([old, ipc] { old->attach(ipc->release()); });
+                dev = ipc;
+            }
+            else
+            {
+                dev = std::make_shared<InputDeviceIpc>(*s);
+            }
+            cfg->inputs.push_back(dev);
+            cfg->sections[dev.get()] = s;
+        }
+        for (auto &s : cfg->ini.find_multi_section("input"))
+        {
+            auto old = previous ? std::dynamic_pointer_cast<InputDeviceEvent>(previous->find_input(s->find_single_value("name"))) : nullptr;
+            const IniSection *olds = old ? previous->sections[old.get()] : nullptr;
+            std::shared_ptr<InputDevice> dev;
+            if (old && same_section(*olds, *s))
+            {
+                dev = old;
+            }
+            else if (old && old->attached() && same_device_criteria(*olds, *s))
+            {
+                FD fd = old->release();
+                std::shared_ptr<InputDeviceEvent> event;
+                try
+                {
+                    event = std::make_shared<InputDeviceEvent>(*s, std::move(fd));
+                }
+                catch (...)
+                {
+                    old->attach(std::move(fd));
+                    throw;
+                }
+                undo.push_back([old, event] { old->attach(event->release()); });
+                dev = event;
+            }
+            else
+            {
+                //Only the devices that match a section are opened, and only if udev does not know what they are.
+                if (!fids_listed && needs_input_device_list(s))
+                {
+                    fids = list_input_devices(devcache);
+                    fids_listed = true;
+                }
+                FD fd = find_input_device_from_section(fids, s);
+                if (!fd)
+                    throw std::runtime_error("input device alreay in use: " + s->find_single_value("name"));
+                //printf("dev='%s'\n", dev.name.c_str());
+                dev = InputDeviceEventCreate(*s, std::move(fd));
+            }
+            cfg->inputs.push_back(dev);
+            cfg->sections[dev.get()] = s;
+        }
+
+        InputFinder<decltype(cfg->inputs.begin())> inputFinder(cfg->inputs.begin(), cfg->inputs.end(), cfg->variables);
+
+        if (const IniSection *vars = cfg->ini.find_single_section("variables"))
+        {
+            for (auto &entry : *vars)
+            {
+                std::unique_ptr<ValueExpr> exp = parse_ref(entry.value(), inputFinder);
+                Variable var(std::move(exp));
+                var.evaluate(); //to get the right default value, particularly for constants
+                cfg->variables.emplace(entry.name(), std::move(var));
+            }
+        }
+
+        //The outputs that are the same uinput device as before are adopted at the end, when nothing can fail
+        std::vector<std::pair<OutputDevice*, OutputDevice*>> adoptions;
+        for (auto &s : cfg->ini.find_multi_section("output"))
+        {
+            std::string id = s->find_single_value("name");
+            printf("name='%s'\n", id.c_str());
+            cfg->outputs.emplace_back(*s, inputFinder);
+            OutputDevice &output = cfg->outputs.back();
+            OutputDevice *old = nullptr;
+            if (previous)
+            {
+                for (auto &o : previous->outputs)
+                {
+                    if (o.created() && o.name() == output.name() && o.same_device(output))
+                    {
+                        old = &o;
+                        break;
+                    }
+                }
+            }
+            if (old)
+                adoptions.emplace_back(&output, old);
+            else
+                output.create();
+        }
+
+        //NOTE: close() an input device may take quite some time, up to 1 second for the full list of devices
+        //(that is 1000 ms!). The FD closes them from a background thread (see close_async), so the unused
+        //devices can be released at any time without delaying the creation of the output devices.
+        fids.clear();
+        SteamController::ClearProbes();
+        SteamController::SetSerialCache(nullptr);
+        devcache.save();
+        set_program_cache(nullptr);
+        progcache.save();
+
+        for (auto &a : adoptions)
+            a.first->adopt(*a.second);
+    }
+    catch (...)
+    {
+        SteamController::ClearProbes();
+        SteamController::SetSerialCache(nullptr);
+        set_program_cache(nullptr);
+        for (auto &u : undo)
+            u();
+        throw;
+    }
+    return cfg;
+}
+
+//Forks before anything starts a thread, as the threads would not survive in the child.
+//The parent waits until the child has built the configuration and exits with its result, so that
+//the errors are still reported to the caller. Returns the pipe to write the result to.
+static FD start_daemon()
+{
+    int pfd[2];
+    test(pipe2(pfd, O_CLOEXEC), "pipe");
+    pid_t pid = fork();
+    test(pid, "fork");
+    if (pid > 0)
+    {
+        close(pfd[1]);
+        char ok = 0;
+        ssize_t res;
+        while ((res = read(pfd[0], &ok, 1)) < 0 && errno == EINTR)
+            ;
+        _exit(res == 1 && ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(pfd[0]);
+    setsid();
+    return FD(pfd[1]);
+}
+
+//Adds the pollable to the epoll set, or updates it if the fd is already there from an older configuration
+static void watch(int epoll_fd, IPollable *pollable)
+{
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = pollable;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, pollable->fd(), &ev) < 0)
+        test(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pollable->fd(), &ev), "EPOLL_CTL_ADD");
+}
+
 int main2(int argc, char **argv)
 {
     int opt;
     std::map<std::string, std::string> defines;
-    while ((opt = getopt(argc, argv, "vdp:m:")) != -1)
+    while ((opt = getopt(argc, argv, "vdp:m:s:")) != -1)
     {
         switch (opt)
         {
@@ -285,6 +759,9 @@ int main2(int argc, char **argv)
         case 'p':
             g_writepid = optarg;
             break;
+        case 's':
+            g_stats_socket = optarg;
+            break;
         case 'm':
             {
                 std::string arg(optarg);
@@ -310,106 +787,40 @@ int main2(int argc, char **argv)
         //if run with -v but without a .ini file, dump the device list instead of the help
         if (g_verbose)
         {
-            list_input_devices();
+            DeviceCache cache;
+            list_input_devices(cache);
+            cache.save();
             exit(1);
         }
         help(argv[0]);
     }
 
     std::string name = argv[optind];
-    IniFile ini(name);
-    if (!defines.empty())
-    {
-        ini.preprocess_values([&defines](std::string v)
-        {
-            auto vv = v;
-            size_t start, end;
-            start = v.find('{');
-            while (start != std::string::npos)
-            {
-                end = v.find('}', start + 1);
-                if (end == std::string::npos)
-                    break;
-                std::string name = v.substr(start + 1, end - start - 1);
-                auto it = defines.find(name);
-                if (it == defines.end())
-                {
-                    fprintf(stderr, "Warning: macro '%s' used but not defined\n", name.c_str());
-                }
-                else
-                {
-                    v = v.substr(0, start) + it->second + v.substr(end + 1);
-                    end += it->second.size() - name.size() - 2; //2 for the '{' and '}'
-                }
-                start = v.find('{', end + 1);
-            }
-            return v;
-        });
-    }
-    //ini.Dump(std::cout);
-
-    std::list<std::shared_ptr<InputDevice>> inputs;
-    std::list<OutputDevice> outputs;
-
-    //NOTE: close() an input device may take quite some time, so closing the full list of devices
-    //may add up to 1 second (that is 1000 ms!). Not a big deal unless you are waiting for the program
-    //to start. The important thing anyone may be waiting for is the creation of the output devices, so we
-    //delay the closing of the input devices until the output devices are created.
-    std::vector<FoundInputDevice> fids = list_input_devices();
-
-    for (auto &s : ini.find_multi_section("steam"))
-    {
-        auto dev = std::make_shared<InputDeviceSteam>(*s);
-        inputs.push_back(dev);
-    }
-    for (auto &s : ini.find_multi_section("input"))
-    {
-        FD fd = find_input_device_from_section(fids, s);
-        if (!fd)
-            throw std::runtime_error("input device alreay in use: " + s->find_single_value("name"));
-        //printf("dev='%s'\n", dev.name.c_str());
-        auto dev = InputDeviceEventCreate(*s, std::move(fd));
-        inputs.push_back(dev);
-    }
-
-    std::map<std::string, Variable> variables;
-
-    InputFinder<decltype(inputs.begin())> inputFinder(inputs.begin(), inputs.end(), variables);
 
-    if (const IniSection *vars = ini.find_single_section("variables"))
-    {
-        for (auto &entry : *vars)
-        {
-            std::unique_ptr<ValueExpr> exp = parse_ref(entry.value(), inputFinder);
-            Variable var(std::move(exp));
-            var.evaluate(); //to get the right default value, particularly for constants
-            variables.emplace(entry.name(), std::move(var));
-        }
-    }
-
-    for (auto &s : ini.find_multi_section("output"))
-    {
-        std::string id = s->find_single_value("name");
-        printf("name='%s'\n", id.c_str());
-        outputs.emplace_back(*s, inputFinder);
-    }
+    //build_config() starts the worker threads of the steam controllers and of close_async(), so daemonize first
+    FD daemon_result;
+    if (g_daemonize)
+        daemon_result = start_daemon();
 
-    //Output devices are already created so now we can close the unused input devices (see note above).
-    fids.clear();
+    //Identities of the devices from the previous runs, so that we do not need to open them all again
+    DeviceCache devcache;
+    std::unique_ptr<Config> cfg = build_config(name, defines, devcache, nullptr);
 
-    if (inputs.empty())
+    if (cfg->inputs.empty())
     {
         fprintf(stderr, "warning: no inputs");
     }
-    if (outputs.empty())
+    if (cfg->outputs.empty())
     {
         fprintf(stderr, "warning: no outputs");
     }
 
-    if (g_daemonize)
+    if (daemon_result)
     {
-        if (daemon(/*nochdir*/1, /*noclose*/1) < 0)
+        char ok = 1;
+        if (write(daemon_result.get(), &ok, 1) < 0)
             perror("daemon");
+        daemon_result.reset();
     }
     if (g_writepid)
     {
@@ -419,20 +830,155 @@ int main2(int argc, char **argv)
 
     FD epoll_fd { epoll_create1(0) };
 
-    for (auto &input : inputs)
+    std::unique_ptr<StatsServer> stats_server;
+    if (g_stats_socket)
     {
+        stats_server.reset(new StatsServer(g_stats_socket));
         epoll_event ev;
         ev.events = EPOLLIN;
-        ev.data.ptr = static_cast<IPollable*>(input.get());
-        test(epoll_ctl(epoll_fd.get(), EPOLL_CTL_ADD, input->fd(), &ev), "EPOLL_CTL_ADD");
+        ev.data.ptr = static_cast<IPollable*>(stats_server.get());
+        test(epoll_ctl(epoll_fd.get(), EPOLL_CTL_ADD, stats_server->fd(), &ev), "EPOLL_CTL_ADD");
     }
-    for (auto &output : outputs)
+    DeviceStats loop_stats("loop");
+    int64_t rates_ns = now_ns() + DeviceStats::RateWindowNs;
+
+    for (auto &input : cfg->inputs)
+        watch(epoll_fd.get(), input.get());
+
+    //A SteamController is handed to the first detached [steam] section that it matches once its serial is known
+    SteamHotplugProber steam_prober([&](SteamController &controller, const std::string &serial, const std::string &syspath)
+    {
+        for (auto &input : cfg->inputs)
+        {
+            auto steam = dynamic_cast<InputDeviceSteam*>(input.get());
+            if (!steam || steam->attached())
+                continue;
+            if (!steam->serial().empty() && steam->serial() != serial)
+                continue;
+            try
+            {
+                steam->attach(std::move(controller));
+                watch(epoll_fd.get(), input.get());
+            }
+            catch (std::exception &e)
+            {
+                if (g_verbose)
+                    fprintf(stderr, "%s: %s\n", syspath.c_str(), e.what());
+                return;
+            }
+            printf("%s: attached %s\n", input->name().c_str(), syspath.c_str());
+            return;
+        }
+    });
+    {
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = static_cast<IPollable*>(&steam_prober);
+        test(epoll_ctl(epoll_fd.get(), EPOLL_CTL_ADD, steam_prober.fd(), &ev), "EPOLL_CTL_ADD");
+    }
+
+    //An input device that fails is detached, and the first device plugged later that matches its section
+    //takes its place. The outputs and the expressions that use it are never recreated.
+    HotplugMonitor hotplug([&](udev_device *dx)
+    {
+        const char *subsystem = udev_device_get_subsystem(dx);
+        bool hidraw = subsystem && strcmp(subsystem, "hidraw") == 0;
+        FoundInputDevice fid;
+        bool identified = false;
+        for (auto &input : cfg->inputs)
+        {
+            if (input->attached())
+                continue;
+            try
+            {
+                if (hidraw)
+                {
+                    //the serial number is queried out of the main loop, see steam_prober
+                    if (!dynamic_cast<InputDeviceSteam*>(input.get()))
+                        continue;
+                    steam_prober.probe(udev_device_get_syspath(dx));
+                    return;
+                }
+                else
+                {
+                    auto event = dynamic_cast<InputDeviceEvent*>(input.get());
+                    if (!event)
+                        continue;
+                    if (!identified)
+                    {
+                        if (!identify_input_device(dx, devcache, fid))
+                            return;
+                        identified = true;
+                    }
+                    if (!input_device_matches(cfg->sections[event], dx, fid))
+                        continue;
+                    FD fd = take_input_device(fid);
+                    if (!fd)
+                        return;
+                    event->attach(std::move(fd));
+                }
+                watch(epoll_fd.get(), input.get());
+            }
+            catch (std::exception &e)
+            {
+                if (g_verbose)
+                    fprintf(stderr, "%s: %s\n", udev_device_get_syspath(dx), e.what());
+                continue;
+            }
+            printf("%s: attached %s\n", input->name().c_str(), udev_device_get_devnode(dx));
+            return;
+        }
+    });
     {
         epoll_event ev;
         ev.events = EPOLLIN;
-        ev.data.ptr = static_cast<IPollable*>(&output);
-        test(epoll_ctl(epoll_fd.get(), EPOLL_CTL_ADD, output.fd(), &ev), "EPOLL_CTL_ADD");
+        ev.data.ptr = static_cast<IPollable*>(&hotplug);
+        test(epoll_ctl(epoll_fd.get(), EPOLL_CTL_ADD, hotplug.fd(), &ev), "EPOLL_CTL_ADD");
     }
+    for (auto &output : cfg->outputs)
+    {
+        //only the uinput sink has a fd
+        if (output.fd() >= 0)
+            watch(epoll_fd.get(), &output);
+    }
+
+    //The new configuration is swapped in between ticks: the inputs and outputs that are not used any more
+    //leave the epoll set before being destroyed, the rest are updated to point to their new owners.
+    auto reload = [&]()
+    {
+        printf("Reloading %s...\n", name.c_str());
+        std::unique_ptr<Config> next;
+        try
+        {
+            next = build_config(name, defines, devcache, cfg.get());
+        }
+        catch (std::exception &e)
+        {
+            fprintf(stderr, "Reload failed, keeping the old configuration: %s\n", e.what());
+            return;
+        }
+        for (auto &input : cfg->inputs)
+        {
+            if (input->attached() && std::find(next->inputs.begin(), next->inputs.end(), input) == next->inputs.end())
+                epoll_ctl(epoll_fd.get(), EPOLL_CTL_DEL, input->fd(), nullptr);
+        }
+        for (auto &output : cfg->outputs)
+        {
+            if (output.fd() >= 0)
+                epoll_ctl(epoll_fd.get(), EPOLL_CTL_DEL, output.fd(), nullptr);
+        }
+        for (auto &input : next->inputs)
+        {
+            if (input->attached())
+                watch(epoll_fd.get(), input.get());
+        }
+        for (auto &output : next->outputs)
+        {
+            if (output.fd() >= 0)
+                watch(epoll_fd.get(), &output);
+        }
+        cfg = std::move(next);
+    };
 
     nice(-10);
 
@@ -455,10 +1001,35 @@ int main2(int argc, char **argv)
         }
     }
 
+    //SIGHUP is only unblocked while waiting, so that a reload never interrupts a tick
+    sigset_t sigmask;
+    sigprocmask(SIG_BLOCK, nullptr, &sigmask);
+    sigdelset(&sigmask, SIGHUP);
+
     while (!g_exit)
     {
+        if (g_reload)
+        {
+            g_reload = false;
+            reload();
+        }
+        //the outputs with max_rate may have frames waiting
+        int64_t deadline = 0;
+        for (auto &d : cfg->outputs)
+        {
+            int64_t t = d.deadline();
+            if (t && (!deadline || t < deadline))
+                deadline = t;
+        }
+        //and the rates of the stats are updated once per window, even if nothing happens
+        if (stats_server && (!deadline || rates_ns < deadline))
+            deadline = rates_ns;
+        int timeout = -1;
+        if (deadline)
+            timeout = std::max<int64_t>(0, (deadline - now_ns() + 999999) / 1000000);
+
         epoll_event epoll_evs[1];
-        int res = epoll_wait(epoll_fd.get(), epoll_evs, countof(epoll_evs), -1);
+        int res = epoll_pwait(epoll_fd.get(), epoll_evs, countof(epoll_evs), timeout, &sigmask);
         if (res == -1)
         {
             if (errno == EINTR)
@@ -466,19 +1037,37 @@ int main2(int argc, char **argv)
             perror("epoll");
             exit(EXIT_FAILURE);
         }
+        int64_t wake_ns = now_ns();
+        if (stats_server && wake_ns >= rates_ns)
+        {
+            DeviceStats::update_rates(wake_ns);
+            rates_ns = wake_ns + DeviceStats::RateWindowNs;
+        }
+        if (res == 0)
+        {
+            for (auto &d : cfg->outputs)
+                d.flush_pending(wake_ns);
+            for (auto &d : cfg->outputs)
+                d.write();
+            continue;
+        }
 
         std::vector<std::shared_ptr<InputDevice>> deletes, synced;
         for (int i = 0; i < res; ++i)
         {
             epoll_event &ev = epoll_evs[i];
             auto pollable = static_cast<IPollable*>(ev.data.ptr);
-            if (ev.events & EPOLLERR)
+            if (ev.events & (EPOLLERR | EPOLLHUP))
             {
                 if (auto input = dynamic_cast<InputDevice*>(pollable))
                     deletes.push_back(input->shared_from_this());
                 continue;
             }
+            int64_t t0 = now_ns();
             auto res = pollable->on_poll(ev.events);
+            DeviceStats *stats = pollable->stats();
+            if (stats)
+                stats->poll.add(now_ns() - t0);
             switch (res)
             {
             case PollResult::None:
@@ -489,25 +1078,79 @@ int main2(int argc, char **argv)
                 break;
             case PollResult::Sync:
                 if (auto input = dynamic_cast<InputDevice*>(pollable))
+                {
                     synced.push_back(input->shared_from_this());
+                    ++stats->syncs;
+                    //the Steam timestamp is taken after the wake up, so no wake time for it
+                    if (input->timestamp() && input->timestamp() <= wake_ns)
+                        stats->wake.add(wake_ns - input->timestamp());
+                }
                 break;
             }
         }
         for (auto &d : deletes)
         {
-            inputs.remove(d);
-            g_exit = true;
+            epoll_ctl(epoll_fd.get(), EPOLL_CTL_DEL, d->fd(), nullptr);
+            d->detach();
+            //there is nothing to plug again for an ipc input, a new socket takes its place
+            if (auto ipc = dynamic_cast<InputDeviceIpc*>(d.get()))
+            {
+                try
+                {
+                    ipc->reopen();
+                    watch(epoll_fd.get(), ipc);
+                    printf("%s: socket %s created again\n", d->name().c_str(), ipc->socket_path().c_str());
+                }
+                catch (std::exception &e)
+                {
+                    fprintf(stderr, "%s: %s\n", d->name().c_str(), e.what());
+                }
+            }
+            else
+            {
+                printf("%s: detached, waiting for it to be plugged again\n", d->name().c_str());
+            }
+            //one last sync, so that the outputs see the values at rest
+            synced.push_back(d);
         }
 
-        for (auto &v : variables)
+        int64_t src_ns = 0;
+        for (auto &d : synced)
+        {
+            if (!src_ns || (d->timestamp() && d->timestamp() < src_ns))
+                src_ns = d->timestamp();
+        }
+
+        int64_t t0 = now_ns();
+        for (auto &v : cfg->variables)
             v.second.evaluate();
+        loop_stats.eval.add(now_ns() - t0);
+        ++loop_stats.syncs;
 
-        for (auto &d : outputs)
-            d.sync();
+        for (auto &d : cfg->outputs)
+            d.evaluate(src_ns);
+        //all the writes together, after all the evaluations
+        int64_t tw = now_ns();
+        for (auto &d : cfg->outputs)
+            d.write();
+        loop_stats.write.add(now_ns() - tw);
         for (auto &d : synced)
+        {
+            int64_t t1 = now_ns();
             d->flush();
+            d->stats()->flush.add(now_ns() - t1);
+        }
     }
     printf("Exiting...\n");
+    for (auto &d : cfg->outputs)
+    {
+        const Histogram &h = d.stats()->latency;
+        if (h.count() == 0)
+            continue;
+        printf("%s: latency p50=%.3fms p99=%.3fms p999=%.3fms max=%.3fms (%llu events)\n", d.name().c_str(),
+                h.percentile(0.50) / 1e6, h.percentile(0.99) / 1e6, h.percentile(0.999) / 1e6, h.max() / 1e6,
+                static_cast<unsigned long long>(h.count()));
+    }
     return EXIT_SUCCESS;
 }
 
@@ -516,8 +1159,14 @@ int main(int argc, char **argv)
     struct sigaction sac {};
     sac.sa_handler = [](int signo) { g_exit = true; };
     sigaction(SIGINT, &sac, nullptr);
-    sigaction(SIGHUP, &sac, nullptr);
     sigaction(SIGTERM, &sac, nullptr);
+    sac.sa_handler = [](int signo) { g_reload = true; };
+    sigaction(SIGHUP, &sac, nullptr);
+    //see the main loop
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigprocmask(SIG_BLOCK, &hup, nullptr);
 
     try
     {
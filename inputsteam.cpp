@@ -23,9 +23,12 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 #include <sys/epoll.h>
 #include <linux/hidraw.h>
 #include <math.h>
+#include <algorithm>
+#include <limits>
 #include "inputdev.h"
 #include "inputsteam.h"
 #include "event-codes.h"
+#include "stats.h"
 
 static EventName g_steam_abs_names[] =
 {
@@ -76,51 +79,177 @@ static EventName g_steam_button_names[] =
     {SteamButton::LPadAndJoy,   "LPadAndJoy"},
 };
 
+static const value_t g_steam_axis_scale[SteamAxisCount] =
+{
+    1 / 32767.0F, //X
+    1 / 32767.0F, //Y
+    1 / 32767.0F, //StickX
+    1 / 32767.0F, //StickY
+    1 / 32767.0F, //LPadX
+    1 / 32767.0F, //LPadY
+    1 / 32767.0F, //RPadX
+    1 / 32767.0F, //RPadY
+    //Should idle be 0 or -1? Currently it is 0
+    1 / 255.0F,   //LTrigger
+    1 / 255.0F,   //RTrigger
+    1 / 32767.0F, //GyroX
+    1 / 32767.0F, //GyroY
+    1 / 32767.0F, //GyroZ
+    1 / 32767.0F, //QuatW
+    1 / 32767.0F, //QuatX
+    1 / 32767.0F, //QuatY
+    1 / 32767.0F, //QuatZ
+};
+
+static EventName g_steam_ff_names[] =
+{
+    {FF_RUMBLE, "Rumble"},
+};
+
+static const EventNameIndex &steam_names()
+{
+    static EventNameIndex index = []
+    {
+        EventNameIndex idx;
+        idx.add(EV_ABS, g_steam_abs_names);
+        idx.add(EV_KEY, g_steam_button_names);
+        idx.add(EV_FF, g_steam_ff_names);
+        return idx;
+    }();
+    return index;
+}
+
 InputDeviceSteam::InputDeviceSteam(const IniSection &ini)
+:InputDeviceSteam(ini, SteamController::Create(ini.find_single_value("serial").c_str()))
+{
+}
+
+InputDeviceSteam::InputDeviceSteam(const IniSection &ini, SteamController &&steam)
 :InputDevice(ini),
-    m_steam(SteamController::Create(ini.find_single_value("serial").c_str()))
+    m_steam(std::move(steam)),
+    m_serial(ini.find_single_value("serial"))
 {
-    bool mouse = parse_bool(ini.find_single_value("mouse"), false);
-    m_steam.set_emulation_mode(mouse? SteamEmulation::Mouse : SteamEmulation::None);
+    try
+    {
+        m_mouse = parse_bool(ini.find_single_value("mouse"), false);
+        setup();
+    }
+    catch (...)
+    {
+        steam = std::move(m_steam);
+        throw;
+    }
 
     std::string auto_haptic = ini.find_single_value("auto_haptic");
     m_auto_haptic_left = auto_haptic.find('l') != std::string::npos ||
                          auto_haptic.find('L') != std::string::npos;
     m_auto_haptic_right = auto_haptic.find('r') != std::string::npos ||
                          auto_haptic.find('R') != std::string::npos;
+
+    reset_values();
+}
+
+//The controller settings, for the first controller and for the ones attached or connected later
+void InputDeviceSteam::setup()
+{
+    m_steam.set_emulation_mode(m_mouse? SteamEmulation::Mouse : SteamEmulation::None);
+    if (m_accel_enabled)
+        m_steam.set_accelerometer(true);
+}
+
+void InputDeviceSteam::reset_values()
+{
+    std::fill(m_axes, m_axes + SteamAxisCount, 0);
+    m_buttons = 0;
+}
+
+void InputDeviceSteam::attach(SteamController steam)
+{
+    m_steam = std::move(steam);
+    setup();
+}
+
+SteamController InputDeviceSteam::release()
+{
+    SteamController steam(std::move(m_steam));
+    reset_values();
+    m_timestamp = 0;
+    return steam;
+}
+
+void InputDeviceSteam::detach()
+{
+    //restore and release the controller now
+    SteamController gone(std::move(m_steam));
+    reset_values();
+    m_timestamp = 0;
 }
 
 ValueId InputDeviceSteam::parse_value(const std::string &name)
 {
-    for (const auto &ev : g_steam_abs_names)
+    const EventCode *ec = steam_names().find(name);
+    if (!ec)
+        throw std::runtime_error("unknown value name " + name);
+    ValueId id(ec->type, ec->code);
+    use_value(id);
+    return id;
+}
+
+void InputDeviceSteam::use_value(const ValueId &id)
+{
+    if (id.type == EV_ABS && id.code >= GyroX && id.code <= QuatZ)
     {
-        if (ev.name == name)
+        if (!m_accel_enabled)
         {
-            if (ev.id >= GyroX && ev.id <= QuatZ)
-            {
-                if (!m_accel_enabled)
-                {
-                    m_accel_enabled = true;
-                    m_steam.set_accelerometer(true);
-                }
-            }
-            return ValueId{ EV_ABS, ev.id };
+            m_accel_enabled = true;
+            //if detached, it is enabled when attached
+            if (attached())
+                m_steam.set_accelerometer(true);
         }
     }
-    for (const auto &ev : g_steam_button_names)
-    {
-        if (ev.name == name)
-            return ValueId{ EV_KEY, ev.id };
-    }
-    if (name == "Rumble")
-        return ValueId(EV_FF, FF_RUMBLE);
-    throw std::runtime_error("unknown value name " + name);
 }
 
 PollResult InputDeviceSteam::on_poll(int event)
 {
-    if (!m_steam.on_poll(event))
+    SteamEvent sev;
+    try
+    {
+        sev = m_steam.on_poll(event);
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "%s: %s\n", name().c_str(), e.what());
+        return PollResult::Error;
+    }
+    switch (sev)
+    {
+    case SteamEvent::Input:
+        break;
+    case SteamEvent::Connected:
+        //the wireless receiver is still there, only the controller needs to be set up again
+        printf("%s: connected\n", name().c_str());
+        setup();
+        return PollResult::None;
+    case SteamEvent::Disconnected:
+        printf("%s: disconnected\n", name().c_str());
+        reset_values();
+        m_timestamp = 0;
+        return PollResult::Sync;
+    default:
         return PollResult::None;
+    }
+    //hidraw reports carry no timestamp, the time of the read is the best we have
+    m_timestamp = now_ns();
+    ++m_stats.events;
+
+    //Decode and scale everything now, so that get_value() is a plain load
+    const SteamState &st = m_steam.state();
+    for (int i = 0; i < SteamAxisCount; ++i)
+        m_axes[i] = st.axes[i] * g_steam_axis_scale[i];
+    m_buttons = st.buttons;
+    //LPadTouch is also reported as LPadAndJoy when the stick is in use, see SteamController::get_button()
+    if (m_buttons & SteamButton::LPadAndJoy)
+        m_buttons |= SteamButton::LPadTouch;
 
     if (m_auto_haptic_left)
         if (m_steam.get_button(SteamButton::LPadTouch))
@@ -133,53 +262,88 @@ PollResult InputDeviceSteam::on_poll(int event)
 
 value_t InputDeviceSteam::get_value(const ValueId &id)
 {
-    /*
-    if (btn & SteamButton::RightPadTouch)
-        send_cmd({0x8f, 0x08, 0x00, 0x64, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00});
-    if (btn & SteamButton::LeftPadTouch)
-        send_cmd({0x8f, 0x08, 0x01, 0x64, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00});
-    */
-
     switch (id.type)
     {
     case EV_ABS:
-        //For some reason the pads are rotated by about 15 degrees
-        switch (id.code)
-        {
-        case SteamAxis::LTrigger:
-        case SteamAxis::RTrigger:
-            //Should idle be 0 or -1? Currently it is 0
-            return m_steam.get_axis(static_cast<SteamAxis>(id.code)) / 255.0F;
-        default:
-            return m_steam.get_axis(static_cast<SteamAxis>(id.code)) / 32767.0F;
-        }
+        return m_axes[id.code];
     case EV_KEY:
-        return m_steam.get_button(static_cast<SteamButton>(id.code));
+        return (m_buttons & id.code) != 0;
     }
     return 0;
 }
 
-int InputDeviceSteam::ff_upload(const ff_effect &eff)
+//The strong motor goes to the left pad, at a lower frequency, and the weak one to the right pad.
+//The magnitude is the duty cycle, up to 50%.
+static SteamHaptic rumble_pulse(int magnitude, int freq, int duration)
 {
-    return 0;
+    if (magnitude <= 0)
+        return SteamHaptic{};
+    int duty = std::max(1, magnitude * 50 / 0xFFFF);
+    return SteamController::haptic_pulse(freq, duty, duration);
+}
+
+int InputDeviceSteam::ff_upload(const ff_effect &eff, int id)
+{
+    if (eff.type != FF_RUMBLE)
+        return -EINVAL;
+    if (id < 0)
+    {
+        auto it = std::find_if(m_effects.begin(), m_effects.end(), [](const Effect &e) { return !e.used; });
+        id = it - m_effects.begin();
+        if (it == m_effects.end())
+            m_effects.push_back(Effect{});
+    }
+    else if (static_cast<unsigned>(id) >= m_effects.size() || !m_effects[id].used)
+    {
+        return -EINVAL;
+    }
+    //a length of 0 is forever, that is as long as a pulse can be
+    int duration = eff.replay.length ? eff.replay.length * 1000 : std::numeric_limits<int>::max();
+    Effect &e = m_effects[id];
+    e.used = true;
+    e.left = rumble_pulse(eff.u.rumble.strong_magnitude, 160, duration);
+    e.right = rumble_pulse(eff.u.rumble.weak_magnitude, 320, duration);
+    //updating a running effect changes it at once
+    if (m_playing == id)
+        ff_run(id, true);
+    return id;
 }
 int InputDeviceSteam::ff_erase(int id)
 {
+    if (static_cast<unsigned>(id) >= m_effects.size() || !m_effects[id].used)
+        return -EINVAL;
+    if (m_playing == id)
+        ff_run(id, false);
+    m_effects[id].used = false;
     return 0;
 }
 void InputDeviceSteam::ff_run(int eff, bool on)
 {
+    if (static_cast<unsigned>(eff) >= m_effects.size() || !m_effects[eff].used)
+        return;
+    const Effect &e = m_effects[eff];
+    //while unplugged only the effect being played is remembered, there is no pad to rumble
+    bool pads = attached();
     if (on)
     {
         //printf("haptic on %d\n", eff);
-        m_steam.haptic(true, 5000, 5000, 65535);
-        m_steam.haptic(false, 5000, 5000, 65535);
+        //the pad not used by this effect would keep the previous one
+        if (pads && m_playing >= 0 && m_playing != eff)
+        {
+            const Effect &p = m_effects[m_playing];
+            if ((p.left.cycles && !e.left.cycles) || (p.right.cycles && !e.right.cycles))
+                m_steam.haptic_stop(p.left.cycles && !e.left.cycles, p.right.cycles && !e.right.cycles);
+        }
+        if (pads)
+            m_steam.haptic_play(e.left, e.right);
+        m_playing = eff;
     }
-    else
+    else if (m_playing == eff)
     {
         //printf("haptic off %d\n", eff);
-        m_steam.haptic(true, 1, 1, 1);
-        m_steam.haptic(false, 1, 1, 1);
+        if (pads)
+            m_steam.haptic_stop(e.left.cycles != 0, e.right.cycles != 0);
+        m_playing = -1;
     }
 }
 
@@ -30,20 +30,46 @@ class InputDeviceSteam : public InputDevice
 {
 public:
     explicit InputDeviceSteam(const IniSection &ini);
+    //steam is only taken if it does not throw
+    InputDeviceSteam(const IniSection &ini, SteamController &&steam);
 
     virtual int fd()
     { return m_steam.fd(); }
     virtual ValueId parse_value(const std::string &name);
+    virtual void use_value(const ValueId &id);
     virtual PollResult on_poll(int event);
     virtual value_t get_value(const ValueId &id);
-    virtual int ff_upload(const ff_effect &eff);
+    virtual int ff_upload(const ff_effect &eff, int id);
     virtual int ff_erase(int id);
     virtual void ff_run(int eff, bool on);
     virtual void flush();
+    virtual void detach();
+    //Takes over a controller that matches this one, with the same settings
+    void attach(SteamController steam);
+    //Gives up the controller as it is, so that another InputDeviceSteam can attach it
+    SteamController release();
+    const std::string &serial() const
+    { return m_serial; }
 private:
     SteamController m_steam;
+    std::string m_serial;
+    bool m_mouse;
+    //the values of the last report, already scaled
+    value_t m_axes[SteamAxisCount];
+    uint32_t m_buttons = 0;
     bool m_accel_enabled = false;
     bool m_auto_haptic_left, m_auto_haptic_right;
+    //FF effects, indexed by id, already translated to pulses of the left and right pads
+    struct Effect
+    {
+        bool used;
+        SteamHaptic left, right;
+    };
+    std::vector<Effect> m_effects;
+    int m_playing = -1;
+
+    void setup();
+    void reset_values();
 };
 
 #endif /* INPUTSTEAM_H_INCLUDED */
@@ -22,6 +22,7 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 #include <linux/uinput.h>
 #include <sys/epoll.h>
 #include <algorithm>
+#include <sstream>
 #include "outputdev.h"
 #include "inputdev.h"
 #include "event-codes.h"
@@ -30,7 +31,6 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 OutputDevice::OutputDevice(const IniSection &ini, IInputByName &inputFinder)
 {
     std::string name = ini.find_single_value("name");
-    std::string phys = ini.find_single_value("phys");
     std::string bus = ini.find_single_value("bus");
     std::string vendor = ini.find_single_value("vendor");
     std::string product = ini.find_single_value("product");
@@ -38,165 +38,491 @@ OutputDevice::OutputDevice(const IniSection &ini, IInputByName &inputFinder)
 
     if (name.empty())
         name = "InputMap";
-    uinput_setup us = {};
+    m_setup = uinput_setup{};
     if (!bus.empty())
-        us.id.bustype = bus_id(bus.c_str());
+        m_setup.id.bustype = bus_id(bus.c_str());
     else
-        us.id.bustype = BUS_VIRTUAL;
-    us.id.version = parse_int(version, 1);
-    us.id.vendor = parse_hex_int(vendor, 0);
-    us.id.product = parse_hex_int(product, 0);
+        m_setup.id.bustype = BUS_VIRTUAL;
+    m_setup.id.version = parse_int(version, 1);
+    m_setup.id.vendor = parse_hex_int(vendor, 0);
+    m_setup.id.product = parse_hex_int(product, 0);
 
-    strcpy(us.name, name.c_str());
+    strncpy(m_setup.name, name.c_str(), sizeof(m_setup.name) - 1);
+    m_name = name;
+    m_phys = ini.find_single_value("phys");
+    m_stats.name = name;
 
-    m_fd = FD_open("/dev/uinput", O_RDWR);
-    test(ioctl(m_fd.get(), UI_SET_PHYS, phys.c_str()), "UI_SET_PHYS");
+    std::string sink = ini.find_single_value("sink");
+    if (sink.empty())
+        sink = "uinput";
+    m_sink_uinput = false;
+    bool sink_shm = false;
+    std::istringstream sinks(sink);
+    std::string s;
+    while (std::getline(sinks, s, ','))
+    {
+        s = trim(s);
+        if (s == "uinput")
+            m_sink_uinput = true;
+        else if (s == "shm")
+            sink_shm = true;
+        else
+            throw std::runtime_error("unknown sink: " + s);
+    }
+    int max_rate = parse_int(ini.find_single_value("max_rate"), 0);
+    if (max_rate < 0)
+        throw std::runtime_error("invalid max_rate");
+    m_period_ns = max_rate ? 1000000000 / max_rate : 0;
 
-    bool has_rel = false;
-    for (const auto &kv : g_rel_names)
+    if (sink_shm)
     {
-        if (!kv.name)
-            continue;
-        std::string ref = ini.find_single_value(kv.name);
-        if (ref.empty())
-            continue;
-        m_rel.emplace_back(kv.id, parse_ref(ref, inputFinder));
-        if (!has_rel)
-        {
-            test(ioctl(m_fd.get(), UI_SET_EVBIT, EV_REL), "EV_REL");
-            has_rel = true;
-        }
-        test(ioctl(m_fd.get(), UI_SET_RELBIT, kv.id), "UI_SET_RELBIT");
+        m_shm_name = ini.find_single_value("shm_name");
+        if (m_shm_name.empty())
+            throw std::runtime_error("sink=shm needs a shm_name");
     }
 
-    bool has_key = false;
-    for (const auto &kv : g_key_names)
+    input_absinfo default_absinfo{};
+    default_absinfo.minimum = -32767;
+    default_absinfo.maximum = 32767;
+    m_absinfo.assign(ABS_CNT, default_absinfo);
+    m_ff_devices.resize(FF_CNT);
+
+    std::vector<bool> used_rel(REL_CNT), used_key(KEY_CNT), used_abs(ABS_CNT), used_ff(FF_CNT);
+    std::vector<std::string> ranged(ABS_CNT);
+    for (const auto &entry : ini)
     {
-        if (!kv.name)
+        const std::string &ename = entry.name();
+        if (ename == "name" || ename == "phys" || ename == "bus" ||
+                ename == "vendor" || ename == "product" || ename == "version" ||
+                ename == "sink" || ename == "shm_name" || ename == "max_rate")
+            continue;
+        size_t dot = ename.find('.');
+        if (dot != std::string::npos)
+        {
+            //ABS_X.min and friends
+            std::string axis = ename.substr(0, dot), prop = ename.substr(dot + 1);
+            const EventCode *ec = find_event_code(axis);
+            if (!ec || ec->type != EV_ABS)
+                throw std::runtime_error("unknown output value: " + ename);
+            input_absinfo &ai = m_absinfo[ec->code];
+            int32_t *field;
+            if (prop == "min")
+                field = &ai.minimum;
+            else if (prop == "max")
+                field = &ai.maximum;
+            else if (prop == "fuzz")
+                field = &ai.fuzz;
+            else if (prop == "flat")
+                field = &ai.flat;
+            else if (prop == "resolution")
+                field = &ai.resolution;
+            else
+                throw std::runtime_error("unknown output value: " + ename);
+            *field = parse_int(entry.value(), *field);
+            ranged[ec->code] = axis;
             continue;
-        std::string ref = ini.find_single_value(kv.name);
+        }
+        const EventCode *ec = find_event_code(ename);
+        if (!ec)
+            throw std::runtime_error("unknown output value: " + ename);
+        //an empty value maps nothing, but it is a duplicate all the same
+        std::vector<bool> *used = nullptr;
+        switch (ec->type)
+        {
+        case EV_REL:
+            used = &used_rel;
+            break;
+        case EV_KEY:
+            used = &used_key;
+            break;
+        case EV_ABS:
+            used = &used_abs;
+            break;
+        case EV_FF:
+            used = &used_ff;
+            break;
+        }
+        if (used)
+        {
+            if ((*used)[ec->code])
+                throw std::runtime_error("multiple " + ename);
+            (*used)[ec->code] = true;
+        }
+        const std::string &ref = entry.value();
         if (ref.empty())
             continue;
-        m_key.emplace_back(kv.id, parse_ref(ref, inputFinder));
-        if (!has_key)
+
+        switch (ec->type)
         {
-            test(ioctl(m_fd.get(), UI_SET_EVBIT, EV_KEY), "EV_KEY");
-            has_key = true;
+        case EV_REL:
+            m_rel.emplace_back(ec->code, parse_ref(ref, inputFinder));
+            break;
+        case EV_KEY:
+            m_key.emplace_back(ec->code, parse_ref(ref, inputFinder));
+            break;
+        case EV_ABS:
+            m_abs.emplace_back(ec->code, parse_ref(ref, inputFinder));
+            break;
+        case EV_FF:
+            {
+                if (!m_sink_uinput)
+                    throw std::runtime_error("FF needs the uinput sink: " + ename);
+                //a comma separated list of devices, each effect is sent to all of them
+                std::vector<std::unique_ptr<ValueRef>> refs;
+                auto &devices = m_ff_devices[ec->code];
+                std::istringstream is(ref);
+                std::string one;
+                while (std::getline(is, one, ','))
+                {
+                    auto pref = parse_ref(trim(one), inputFinder);
+                    auto xref = dynamic_cast<ValueRef*>(pref.get());
+                    if (!xref || xref->get_value_id().type != EV_FF || xref->get_value_id().code != ec->code)
+                    {
+                        throw std::runtime_error("FF ref must be a simple reference to the same FF value");
+                    }
+                    pref.release();
+                    refs.emplace_back(xref);
+                    InputDevice *device = xref->get_device().get();
+                    if (std::find(devices.begin(), devices.end(), device) != devices.end())
+                        throw std::runtime_error("FF device repeated: " + ename);
+                    devices.push_back(device);
+                }
+                if (refs.empty())
+                    throw std::runtime_error("FF ref must be a simple reference to the same FF value");
+                m_ff.emplace_back(ec->code, std::move(refs));
+                m_setup.ff_effects_max = 16;
+            }
+            break;
         }
-        test(ioctl(m_fd.get(), UI_SET_KEYBIT, kv.id), "UI_SET_KEYBIT");
     }
 
-    bool has_abs = false;
-    for (const auto &kv : g_abs_names)
+    for (int i = 0; i < ABS_CNT; ++i)
     {
-        if (!kv.name)
-            continue;
-        std::string ref = ini.find_single_value(kv.name);
-        if (ref.empty())
+        if (ranged[i].empty())
             continue;
-        m_abs.emplace_back(kv.id, parse_ref(ref, inputFinder));
-        if (!has_abs)
-        {
-            test(ioctl(m_fd.get(), UI_SET_EVBIT, EV_ABS), "EV_ABS");
-            has_abs = true;
-        }
+        if (std::none_of(m_abs.begin(), m_abs.end(), [i](const std::pair<int, std::unique_ptr<ValueExpr>> &v) { return v.first == i; }))
+            throw std::runtime_error("range for unused output value: " + ranged[i]);
+        if (m_absinfo[i].minimum >= m_absinfo[i].maximum)
+            throw std::runtime_error("invalid range for output value: " + ranged[i]);
+    }
+    for (auto &v : m_abs)
+        m_abs_raw.push_back(dynamic_cast<ValueRef*>(v.second.get()));
+}
+
+void OutputDevice::create()
+{
+    if (!m_shm_name.empty())
+    {
+        //the same order as the events of sync()
+        std::vector<inputmap_shm_code> codes;
+        for (auto &v : m_rel)
+            codes.push_back(inputmap_shm_code{EV_REL, static_cast<uint16_t>(v.first)});
+        for (auto &v : m_key)
+            codes.push_back(inputmap_shm_code{EV_KEY, static_cast<uint16_t>(v.first)});
+        for (auto &v : m_abs)
+            codes.push_back(inputmap_shm_code{EV_ABS, static_cast<uint16_t>(v.first)});
+        m_shm.reset(new ShmSink(m_shm_name, codes));
+    }
+    if (!m_sink_uinput)
+        return;
+
+    //non blocking, so that on_poll() can drain all the pending FF requests
+    m_fd = FD_open("/dev/uinput", O_RDWR | O_NONBLOCK);
+    test(ioctl(m_fd.get(), UI_SET_PHYS, m_phys.c_str()), "UI_SET_PHYS");
+
+    if (!m_rel.empty())
+        test(ioctl(m_fd.get(), UI_SET_EVBIT, EV_REL), "EV_REL");
+    for (auto &v : m_rel)
+        test(ioctl(m_fd.get(), UI_SET_RELBIT, v.first), "UI_SET_RELBIT");
+
+    if (!m_key.empty())
+        test(ioctl(m_fd.get(), UI_SET_EVBIT, EV_KEY), "EV_KEY");
+    for (auto &v : m_key)
+        test(ioctl(m_fd.get(), UI_SET_KEYBIT, v.first), "UI_SET_KEYBIT");
+
+    if (!m_abs.empty())
+        test(ioctl(m_fd.get(), UI_SET_EVBIT, EV_ABS), "EV_ABS");
+    for (auto &v : m_abs)
+    {
         uinput_abs_setup abs = {};
-        abs.code = kv.id;
-        abs.absinfo.minimum = -32767;
-        abs.absinfo.maximum = 32767; //TODO: configure ABS range
+        abs.code = v.first;
+        abs.absinfo = m_absinfo[v.first];
         test(ioctl(m_fd.get(), UI_ABS_SETUP, &abs), "abs");
     }
 
-    bool has_ff = false;
-    for (const auto &kv : g_ff_names)
+    if (!m_ff.empty())
+        test(ioctl(m_fd.get(), UI_SET_EVBIT, EV_FF), "EV_FF");
+    for (auto &v : m_ff)
+        test(ioctl(m_fd.get(), UI_SET_FFBIT, v.first), "UI_SET_FFBIT");
+
+    test(ioctl(m_fd.get(), UI_DEV_SETUP, &m_setup), "UI_DEV_SETUP");
+    test(ioctl(m_fd.get(), UI_DEV_CREATE, 0), "UI_DEV_CREATE");
+}
+
+template <typename T>
+static std::vector<int> sorted_codes(const std::vector<std::pair<int, T>> &values)
+{
+    std::vector<int> res;
+    for (auto &v : values)
+        res.push_back(v.first);
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+bool OutputDevice::same_device(const OutputDevice &o) const
+{
+    return memcmp(&m_setup, &o.m_setup, sizeof(m_setup)) == 0 &&
+        m_phys == o.m_phys &&
+        m_sink_uinput == o.m_sink_uinput &&
+        m_shm_name == o.m_shm_name &&
+        sorted_codes(m_rel) == sorted_codes(o.m_rel) &&
+        sorted_codes(m_key) == sorted_codes(o.m_key) &&
+        sorted_codes(m_abs) == sorted_codes(o.m_abs) &&
+        sorted_codes(m_ff) == sorted_codes(o.m_ff) &&
+        same_ranges(o);
+}
+
+bool OutputDevice::same_ranges(const OutputDevice &o) const
+{
+    for (auto &v : m_abs)
+        if (memcmp(&m_absinfo[v.first], &o.m_absinfo[v.first], sizeof(input_absinfo)) != 0)
+            return false;
+    return true;
+}
+
+void OutputDevice::adopt(OutputDevice &o)
+{
+    m_fd = std::move(o.m_fd);
+    m_shm = std::move(o.m_shm);
+    m_effects = std::move(o.m_effects);
+    //The effects live on: they are erased from the devices that are not used any more, that are still alive
+    //in the old configuration, and uploaded to the new ones, such as those that replace a changed input section.
+    //The same FF codes are mapped, or it would not be the same device.
+    int lost = 0;
+    for (size_t id = 0; id < m_effects.size(); ++id)
     {
-        if (!kv.name)
-            continue;
-        std::string ref = ini.find_single_value(kv.name);
-        if (ref.empty())
+        auto &effect = m_effects[id];
+        if (effect.type < 0)
             continue;
-        auto pref = parse_ref(ref, inputFinder);
-        auto xref = dynamic_cast<ValueRef*>(pref.get());
-        if (!xref || xref->get_value_id().type != EV_FF || xref->get_value_id().code != kv.id)
+        const std::vector<InputDevice*> &devices = m_ff_devices[effect.type];
+        std::vector<FFTarget> targets;
+        for (auto &t : effect.targets)
         {
-            throw std::runtime_error("FF ref must be a simple reference to the same FF value");
+            if (std::find(devices.begin(), devices.end(), t.device) != devices.end())
+                targets.push_back(t);
+            else
+                t.device->ff_erase(t.input_id);
         }
-        pref.release();
-        m_ff.emplace_back(kv.id, std::unique_ptr<ValueRef>(xref));
-        if (!has_ff)
+        for (InputDevice *device : devices)
         {
-            us.ff_effects_max = 16;
-            test(ioctl(m_fd.get(), UI_SET_EVBIT, EV_FF), "EV_FF");
-            has_ff = true;
+            if (std::find_if(targets.begin(), targets.end(), [device](const FFTarget &t) { return t.device == device; }) != targets.end())
+                continue;
+            int in_id = device->ff_upload(effect.effect, -1);
+            if (in_id >= 0)
+                targets.push_back(FFTarget{device, in_id});
         }
-        test(ioctl(m_fd.get(), UI_SET_FFBIT, kv.id), "UI_SET_FFBIT");
+        effect.targets = std::move(targets);
+        if (effect.targets.empty())
+            ++lost;
     }
-
-    test(ioctl(m_fd.get(), UI_DEV_SETUP, &us), "UI_DEV_SETUP");
-    test(ioctl(m_fd.get(), UI_DEV_CREATE, 0), "UI_DEV_CREATE");
+    if (lost)
+        fprintf(stderr, "%s: %d force feedback effects could not be uploaded to the new devices\n", m_name.c_str(), lost);
 }
 
-inline input_event create_event(int type, int code, int value)
+inline input_event create_event(int64_t time_ns, int type, int code, int value)
 {
     input_event ev;
+    set_event_time(ev, time_ns);
     ev.type = type;
     ev.code = code;
     ev.value = value;
     return ev;
 }
 
-inline void do_event(std::vector<input_event> &evs, int type, int code, ValueExpr *ref)
+inline void do_event(std::vector<input_event> &evs, int64_t time_ns, int type, int code, ValueExpr *ref)
 {
     if (!ref)
         return;
 
     value_t value = ref->get_value();
-    if (type == EV_ABS)
-        value *= 32767;
-    evs.push_back(create_event(type, code, static_cast<int>(value)));
+    evs.push_back(create_event(time_ns, type, code, static_cast<int>(value)));
 }
 
-void OutputDevice::sync()
+//ABS values go from -1 to 1, scaled to the range of the axis.
+//A plain reference to an axis with the same range is copied as is.
+inline void do_abs_event(std::vector<input_event> &evs, int64_t time_ns, int code, ValueExpr *ref, ValueRef *raw, const input_absinfo &ai)
 {
-    std::vector<input_event> evs;
+    if (!ref)
+        return;
+
+    int value;
+    if (!raw || !raw->get_raw_abs(ai, value))
+    {
+        value_t x = ref->get_value();
+#ifdef INPUTMAP_FIXED_POINT
+        //the range may not fit in the fixed point range
+        x = std::max<value_t>(-1, std::min<value_t>(1, x));
+        value = ai.minimum + ((static_cast<int64_t>(x.raw()) + Fixed::One) * (static_cast<int64_t>(ai.maximum) - ai.minimum) >> (Fixed::Shift + 1));
+#else
+        x = ai.minimum + (x + 1) / 2 * (static_cast<value_t>(ai.maximum) - ai.minimum);
+        x = std::max<value_t>(ai.minimum, std::min<value_t>(ai.maximum, x));
+        value = static_cast<int>(x);
+#endif
+    }
+    evs.push_back(create_event(time_ns, EV_ABS, code, value));
+}
+
+void OutputDevice::evaluate(int64_t src_ns)
+{
+    std::vector<input_event> &evs = m_frame;
+    evs.clear();
+    //the kernel timestamps the events again, but we keep the input time anyway
+    int64_t t0 = now_ns();
+    int64_t time_ns = src_ns ? src_ns : t0;
 
     for (auto &v: m_rel)
-        do_event(evs, EV_REL, v.first, v.second.get());
+        do_event(evs, time_ns, EV_REL, v.first, v.second.get());
     for (auto &v: m_key)
-        do_event(evs, EV_KEY, v.first, v.second.get());
-    for (auto &v: m_abs)
-        do_event(evs, EV_ABS, v.first, v.second.get());
+        do_event(evs, time_ns, EV_KEY, v.first, v.second.get());
+    for (size_t i = 0; i < m_abs.size(); ++i)
+        do_abs_event(evs, time_ns, m_abs[i].first, m_abs[i].second.get(), m_abs_raw[i], m_absinfo[m_abs[i].first]);
+
+    int64_t t1 = now_ns();
+    m_stats.eval.add(t1 - t0);
+
+    if (evs.empty())
+        return;
+    if (!m_period_ns)
+    {
+        queue_frames(evs, src_ns);
+        m_out.push_back(create_event(time_ns, EV_SYN, SYN_REPORT, 0));
+        return;
+    }
+    merge_pending(evs, time_ns, src_ns);
+    flush_pending(t1);
+}
 
-    if (!evs.empty())
+//Adds the frame to the one waiting for the next emission: REL values are added up, KEY and ABS keep
+//the latest value. A key that changes twice would lose a press or a release, so the waiting frame is
+//closed first and both go out together.
+void OutputDevice::merge_pending(const std::vector<input_event> &evs, int64_t time_ns, int64_t src_ns)
+{
+    //the first time, start from the values of a new device, all zeros, so that the changes
+    //in the first interval are tracked like in any other
+    if (m_pending.empty())
     {
-        evs.push_back(create_event(EV_SYN, SYN_REPORT, 0));
-        test(write(m_fd.get(), evs.data(), evs.size() * sizeof(input_event)), "write");
+        m_pending = evs;
+        for (auto &ev : m_pending)
+            ev.value = 0;
+        m_key_changed.assign(m_key.size(), false);
     }
+    size_t nrel = m_rel.size(), nkey = m_key.size();
+    for (size_t i = 0; i < nrel; ++i)
+        m_pending[i].value += evs[i].value;
+    for (size_t i = 0; i < nkey; ++i)
+    {
+        input_event &ev = m_pending[nrel + i];
+        if (ev.value == evs[nrel + i].value)
+            continue;
+        if (m_key_changed[i])
+            close_pending(time_ns);
+        ev.value = evs[nrel + i].value;
+        m_key_changed[i] = true;
+    }
+    for (size_t i = nrel + nkey; i < evs.size(); ++i)
+        m_pending[i].value = evs[i].value;
+    if (m_pending_src_ns < 0)
+        m_pending_src_ns = src_ns;
+    else
+        ++m_stats.merged;
+    for (auto &ev : m_pending)
+        set_event_time(ev, time_ns);
 }
 
-ValueRef *OutputDevice::get_ff(int id)
+void OutputDevice::close_pending(int64_t time_ns)
 {
-    for (auto &v: m_ff)
-        if (v.first == id)
-            return v.second.get();
-    return nullptr;
+    m_closed.insert(m_closed.end(), m_pending.begin(), m_pending.end());
+    m_closed.push_back(create_event(time_ns, EV_SYN, SYN_REPORT, 0));
+    for (size_t i = 0; i < m_rel.size(); ++i)
+        m_pending[i].value = 0;
+    std::fill(m_key_changed.begin(), m_key_changed.end(), false);
+}
+
+void OutputDevice::flush_pending(int64_t now)
+{
+    if (m_pending_src_ns < 0 || now < m_next_ns)
+        return;
+    close_pending(event_time_ns(m_pending.back()));
+    queue_frames(m_closed, m_pending_src_ns);
+    m_closed.clear();
+    m_pending_src_ns = -1;
+    m_next_ns = now + m_period_ns;
+}
+
+void OutputDevice::queue_frames(const std::vector<input_event> &evs, int64_t src_ns)
+{
+    if (m_out.empty() || (src_ns && src_ns < m_out_src_ns))
+        m_out_src_ns = src_ns;
+    m_out.insert(m_out.end(), evs.begin(), evs.end());
+}
+
+//m_out is one or more frames, each one with all the values and a SYN_REPORT
+void OutputDevice::write()
+{
+    if (m_out.empty())
+        return;
+    int64_t t1 = now_ns();
+    size_t frame = m_rel.size() + m_key.size() + m_abs.size() + 1;
+    if (m_shm)
+    {
+        for (size_t i = 0; i + frame <= m_out.size(); i += frame)
+            m_shm->publish(event_time_ns(m_out[i]), &m_out[i], frame - 1);
+    }
+    size_t size = m_out.size() * sizeof(input_event);
+    if (m_fd.get() >= 0)
+    {
+        test(::write(m_fd.get(), m_out.data(), size), "write");
+        ++m_stats.writes;
+    }
+    int64_t t2 = now_ns();
+    m_stats.write.add(t2 - t1);
+    m_stats.bytes += size;
+    m_stats.syncs += m_out.size() / frame;
+    if (m_out_src_ns)
+        m_stats.latency.add(t2 - m_out_src_ns);
+    m_out.clear();
 }
 
 PollResult OutputDevice::on_poll(int event)
 {
     if ((event & EPOLLIN) == 0)
         return PollResult::None;
-    input_event ev;
 
-    int res = read(fd(), &ev, sizeof(input_event));
-    if (res == -1)
+    //Read all the pending requests, a game usually uploads or plays several effects at once
+    input_event evs[16];
+    for (;;)
     {
-        if (errno == EINTR)
-            return PollResult::None;
-        perror("output read");
-        return PollResult::Error;
+        int res = read(fd(), evs, sizeof(evs));
+        if (res == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            perror("output read");
+            return PollResult::Error;
+        }
+        int count = res / sizeof(input_event);
+        for (int i = 0; i < count; ++i)
+            on_ff_event(evs[i]);
+        if (count < static_cast<int>(sizeof(evs) / sizeof(*evs)))
+            break;
     }
+    return PollResult::None;
+}
 
+void OutputDevice::on_ff_event(const input_event &ev)
+{
     //printf("EV %d %d %d\n", ev.type, ev.code, ev.value);
 
     switch (ev.type)
@@ -209,21 +535,8 @@ PollResult OutputDevice::on_poll(int event)
                 uinput_ff_upload ff{};
                 ff.request_id = ev.value;
                 test(ioctl(m_fd.get(), UI_BEGIN_FF_UPLOAD, &ff), "UI_BEGIN_FF_UPLOAD");
-                //printf("UPLOAD 0x%X, id=%d (%d, %d)\n", ff.effect.type, ff.effect.id, ff.effect.u.rumble.weak_magnitude, ff.effect.u.rumble.strong_magnitude);
-                ValueRef *ffout = get_ff(ff.effect.type);
-                auto device = ffout ? ffout->get_device() : nullptr;
-                int out_id = ff.effect.id;
-                int in_id = out_id < 0 || !device ? -EINVAL : device->ff_upload(ff.effect);
-                ff.retval = in_id < 0 ? in_id : 0;
+                ff_upload(ff);
                 test(ioctl(m_fd.get(), UI_END_FF_UPLOAD, &ff), "UI_END_FF_UPLOAD");
-                if (in_id >= 0)
-                {
-                    if (static_cast<unsigned>(out_id) >= m_effects.size())
-                        m_effects.resize(out_id + 1);
-                    auto &effect = m_effects[out_id];
-                    effect.device = device;
-                    effect.input_id = in_id;
-                }
             }
             break;
         case UI_FF_ERASE:
@@ -231,30 +544,7 @@ PollResult OutputDevice::on_poll(int event)
                 uinput_ff_erase ff{};
                 ff.request_id = ev.value;
                 test(ioctl(m_fd.get(), UI_BEGIN_FF_ERASE, &ff), "UI_BEGIN_FF_ERASE");
-                //printf("ERASE %d\n", ff.effect_id);
-                if (ff.effect_id < 0 || ff.effect_id >= m_effects.size())
-                {
-                    ff.retval = -EINVAL;
-                }
-                else
-                {
-                    auto &effect = m_effects[ff.effect_id];
-                    auto device = effect.device.lock();
-                    int in_id = effect.input_id;
-                    effect = FFEffect{};
-                    if (device)
-                    {
-                        int err = device->ff_erase(in_id);
-                        if (err < 0)
-                            ff.retval = err;
-                        else
-                            ff.retval = 0;
-                    }
-                    else
-                    {
-                        ff.retval = -EINVAL;
-                    }
-                }
+                ff_erase(ff);
                 test(ioctl(m_fd.get(), UI_END_FF_ERASE, &ff), "UI_END_FF_ERASE");
             }
             break;
@@ -263,17 +553,78 @@ PollResult OutputDevice::on_poll(int event)
     case EV_FF:
         {
             //printf("FF %s id=%d\n", ev.value? "start" : "stop", ev.code);
-            if (ev.code >= 0 && ev.code < m_effects.size())
+            if (ev.code < m_effects.size())
             {
-                auto &effect = m_effects[ev.code];
-                auto device = effect.device.lock();
-                if (device)
-                    device->ff_run(effect.input_id, ev.value != 0);
+                for (auto &t : m_effects[ev.code].targets)
+                    t.device->ff_run(t.input_id, ev.value != 0);
             }
         }
         break;
     }
+}
 
-    return PollResult::None;
+void OutputDevice::ff_upload(uinput_ff_upload &ff)
+{
+    //printf("UPLOAD 0x%X, id=%d (%d, %d)\n", ff.effect.type, ff.effect.id, ff.effect.u.rumble.weak_magnitude, ff.effect.u.rumble.strong_magnitude);
+    int out_id = ff.effect.id;
+    int type = ff.effect.type;
+    if (out_id < 0 || type < 0 || type >= FF_CNT || m_ff_devices[type].empty())
+    {
+        ff.retval = -EINVAL;
+        return;
+    }
+    if (static_cast<unsigned>(out_id) >= m_effects.size())
+        m_effects.resize(out_id + 1, FFEffect{-1, {}, {}});
+    auto &effect = m_effects[out_id];
+    //an effect may be updated with a different type, then the old one is erased
+    if (effect.type != type)
+    {
+        for (auto &t : effect.targets)
+            t.device->ff_erase(t.input_id);
+        effect.targets.clear();
+        effect.type = type;
+    }
+
+    //It succeeds if any of the devices takes it
+    std::vector<FFTarget> targets;
+    int err = -ENODEV;
+    for (InputDevice *device : m_ff_devices[type])
+    {
+        auto it = std::find_if(effect.targets.begin(), effect.targets.end(), [device](const FFTarget &t) { return t.device == device; });
+        int in_id = device->ff_upload(ff.effect, it == effect.targets.end() ? -1 : it->input_id);
+        if (in_id >= 0)
+        {
+            targets.push_back(FFTarget{device, in_id});
+        }
+        else
+        {
+            err = in_id;
+            //the old effect would stay in that device, with no way left to stop it
+            if (it != effect.targets.end())
+                device->ff_erase(it->input_id);
+        }
+    }
+    effect.targets = std::move(targets);
+    effect.effect = ff.effect;
+    ff.retval = effect.targets.empty() ? err : 0;
+}
+
+void OutputDevice::ff_erase(uinput_ff_erase &ff)
+{
+    //printf("ERASE %d\n", ff.effect_id);
+    if (ff.effect_id >= m_effects.size())
+    {
+        ff.retval = -EINVAL;
+        return;
+    }
+    auto &effect = m_effects[ff.effect_id];
+    ff.retval = effect.targets.empty() ? -EINVAL : 0;
+    for (auto &t : effect.targets)
+    {
+        int err = t.device->ff_erase(t.input_id);
+        if (err < 0)
+            ff.retval = err;
+    }
+    effect = FFEffect{-1, {}, {}};
 }
 
@@ -22,37 +22,103 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef OUTPUTDEV_H_INCLUDED
 #define OUTPUTDEV_H_INCLUDED
 
+#include <linux/uinput.h>
 #include "steam/fd.h"
 #include "inifile.h"
 #include "inputdev.h"
 #include "devinput-parser.h"
+#include "stats.h"
+#include "shmsink.h"
 
-struct FFEffect
+//The effect uploaded to one of the physical devices of an FF value
+struct FFTarget
 {
-    std::weak_ptr<InputDevice> device;
+    InputDevice *device;
     int input_id;
 };
 
+struct FFEffect
+{
+    int type;
+    //as uploaded, to upload it again to the devices of a new configuration
+    ff_effect effect;
+    std::vector<FFTarget> targets;
+};
+
 class OutputDevice : public IPollable
 {
 public:
+    //Only parses the section, the uinput device is created by create() or taken by adopt()
     OutputDevice(const IniSection &ini, IInputByName &inputFinder);
-    void sync();
+    void create();
+    //Whether it owns its uinput device or shared memory, that is, it has been created and not adopted by another one
+    bool created() const
+    { return m_fd.get() >= 0 || m_shm; }
+    //Whether the uinput devices would be the same: name, id and capabilities
+    bool same_device(const OutputDevice &o) const;
+    //Takes over the uinput device of an older configuration
+    void adopt(OutputDevice &o);
+    //Evaluates the values of this tick, the frame to write is kept until write(), so that all
+    //the outputs are written together after all the evaluations.
+    //src_ns: timestamp of the oldest input event of this tick, 0 if none
+    void evaluate(int64_t src_ns);
+    void write();
+    //With max_rate, queues the frames waiting since the last emission if it is time to.
+    //deadline() is when it will be, 0 if nothing is waiting.
+    void flush_pending(int64_t now);
+    int64_t deadline() const
+    { return m_pending_src_ns < 0 ? 0 : m_next_ns; }
+
+    const std::string &name() const noexcept
+    { return m_name; }
+    virtual DeviceStats *stats() override
+    { return &m_stats; }
 
     virtual int fd() override { return m_fd.get(); }
     virtual PollResult on_poll(int event) override;
 
 private:
+    std::string m_name, m_phys;
+    uinput_setup m_setup;
     FD m_fd;
+    //sink=uinput,shm
+    bool m_sink_uinput;
+    std::string m_shm_name;
+    std::unique_ptr<ShmSink> m_shm;
     std::vector<std::pair<int, std::unique_ptr<ValueExpr>>> m_rel;
     std::vector<std::pair<int, std::unique_ptr<ValueExpr>>> m_key;
     std::vector<std::pair<int, std::unique_ptr<ValueExpr>>> m_abs;
-    std::vector<std::pair<int, std::unique_ptr<ValueRef>>> m_ff;
+    //Parallel to m_abs: the expression if it is a plain reference that may be copied as an integer
+    std::vector<ValueRef*> m_abs_raw;
+    //Indexed by ABS code
+    std::vector<input_absinfo> m_absinfo;
+    //An FF value may go to several physical devices
+    std::vector<std::pair<int, std::vector<std::unique_ptr<ValueRef>>>> m_ff;
+    //Indexed by FF code, the devices of m_ff. The refs keep them alive.
+    std::vector<std::vector<InputDevice*>> m_ff_devices;
 
-    ValueRef *get_ff(int id);
+    bool same_ranges(const OutputDevice &o) const;
+    void merge_pending(const std::vector<input_event> &evs, int64_t time_ns, int64_t src_ns);
+    void close_pending(int64_t time_ns);
+    void queue_frames(const std::vector<input_event> &evs, int64_t src_ns);
+    void on_ff_event(const input_event &ev);
+    void ff_upload(uinput_ff_upload &ff);
+    void ff_erase(uinput_ff_erase &ff);
     void write_value(int type, int code, int value);
 
+    //max_rate: the frame being accumulated, and the frames closed before it, each one with its SYN_REPORT
+    int64_t m_period_ns;
+    int64_t m_next_ns = 0;
+    int64_t m_pending_src_ns = -1;
+    std::vector<input_event> m_pending, m_closed;
+    std::vector<bool> m_key_changed;
+    //the values evaluated in this tick, and the frames ready for write()
+    std::vector<input_event> m_frame, m_out;
+    int64_t m_out_src_ns = 0;
+
+    //Indexed by the effect id of the uinput device
     std::vector<FFEffect> m_effects;
+    DeviceStats m_stats{"output"};
 };
 
 #endif /* OUTPUTDEV_H_INCLUDED */
@@ -0,0 +1,218 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <sstream>
+#include "progcache.h"
+#include "devcache.h"
+#include "devinput.h"
+#include "steam/fd.h"
+
+extern bool g_verbose;
+
+struct ProgramCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t value_kind;
+    uint64_t key;
+    uint64_t count;
+};
+
+//Followed by the text padded to a full word, and then the program
+struct ProgramCacheEntry
+{
+    uint32_t text_size;
+    uint32_t program_size;
+};
+
+static const char g_cache_magic[8] = "IMAPPRG";
+static const uint32_t g_cache_version = 2;
+//The constants are saved as the raw value_t, so a cache is only valid for the same kind of build
+#ifdef INPUTMAP_FIXED_POINT
+static const uint32_t g_value_kind = 1;
+#else
+static const uint32_t g_value_kind = 0;
+#endif
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t size)
+{
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+uint64_t ProgramCache::make_key(const std::string &file, const std::map<std::string, std::string> &defines)
+{
+    uint64_t h = 14695981039346656037ULL;
+    std::ifstream ifs(file);
+    std::ostringstream os;
+    os << ifs.rdbuf();
+    std::string text = os.str();
+    h = fnv1a(h, text.data(), text.size());
+    for (auto &d : defines)
+    {
+        h = fnv1a(h, d.first.c_str(), d.first.size() + 1);
+        h = fnv1a(h, d.second.c_str(), d.second.size() + 1);
+    }
+    //the operators are saved as the parser tokens, that may change with the grammar
+    const uint32_t tokens[] = {InputToken_PLUS, InputToken_MINUS, InputToken_AND, InputToken_OR, InputToken_GT,
+        InputToken_LT, InputToken_MULT, InputToken_DIV, InputToken_NOT};
+    h = fnv1a(h, tokens, sizeof(tokens));
+    return h;
+}
+
+ProgramCache::ProgramCache(uint64_t key)
+    :m_key(key), m_map(nullptr), m_map_size(0)
+{
+    std::string dir = cache_dir();
+    if (dir.empty())
+        return;
+    m_path = dir + "/programs";
+
+    FD fd { open(m_path.c_str(), O_RDONLY | O_CLOEXEC) };
+    if (!fd)
+        return;
+    struct stat st;
+    if (fstat(fd.get(), &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(ProgramCacheHeader))
+        return;
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+    if (map == MAP_FAILED)
+        return;
+    m_map = map;
+    m_map_size = st.st_size;
+
+    const ProgramCacheHeader *hdr = static_cast<const ProgramCacheHeader*>(m_map);
+    if (memcmp(hdr->magic, g_cache_magic, sizeof(hdr->magic)) != 0 || hdr->version != g_cache_version || hdr->value_kind != g_value_kind)
+    {
+        if (g_verbose)
+            printf("Ignoring invalid program cache %s\n", m_path.c_str());
+        return;
+    }
+    if (hdr->key != m_key)
+        return; //another configuration
+
+    const uint32_t *p = reinterpret_cast<const uint32_t*>(hdr + 1);
+    const uint32_t *end = p + (m_map_size - sizeof(ProgramCacheHeader)) / sizeof(uint32_t);
+    for (uint64_t i = 0; i < hdr->count; ++i)
+    {
+        if (end - p < 2)
+            break;
+        const ProgramCacheEntry *entry = reinterpret_cast<const ProgramCacheEntry*>(p);
+        size_t text_words = (entry->text_size + 3) / 4;
+        p += 2;
+        if (static_cast<size_t>(end - p) < text_words + entry->program_size)
+            break;
+        std::string text(reinterpret_cast<const char*>(p), entry->text_size);
+        p += text_words;
+        m_loaded[text] = std::make_pair(p, entry->program_size);
+        p += entry->program_size;
+    }
+}
+
+ProgramCache::~ProgramCache()
+{
+    if (m_map)
+        munmap(m_map, m_map_size);
+}
+
+const uint32_t *ProgramCache::find(const std::string &text, size_t &size) const
+{
+    auto it = m_loaded.find(text);
+    if (it == m_loaded.end())
+        return nullptr;
+    size = it->second.second;
+    return it->second.first;
+}
+
+void ProgramCache::add(const std::string &text, std::vector<uint32_t> program)
+{
+    m_added[text] = std::move(program);
+}
+
+void ProgramCache::save()
+{
+    if (m_added.empty() || m_path.empty())
+        return;
+
+    std::vector<uint32_t> data;
+    auto append = [&data](const std::string &text, const uint32_t *program, size_t size)
+    {
+        data.push_back(text.size());
+        data.push_back(size);
+        size_t pos = data.size();
+        data.resize(pos + (text.size() + 3) / 4);
+        memcpy(&data[pos], text.data(), text.size());
+        data.insert(data.end(), program, program + size);
+    };
+    uint64_t count = 0;
+    for (auto &p : m_loaded)
+    {
+        if (m_added.count(p.first))
+            continue;
+        append(p.first, p.second.first, p.second.second);
+        ++count;
+    }
+    for (auto &p : m_added)
+    {
+        append(p.first, p.second.data(), p.second.size());
+        ++count;
+    }
+
+    std::string dir = cache_dir();
+    mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0755);
+    mkdir(dir.c_str(), 0755);
+
+    //write a new file and rename it, as the old one may still be mapped
+    std::string tmp = m_path + ".tmp";
+    FD fd { open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) };
+    if (!fd)
+    {
+        if (g_verbose)
+            perror(tmp.c_str());
+        return;
+    }
+    ProgramCacheHeader hdr = {};
+    memcpy(hdr.magic, g_cache_magic, sizeof(hdr.magic));
+    hdr.version = g_cache_version;
+    hdr.value_kind = g_value_kind;
+    hdr.key = m_key;
+    hdr.count = count;
+    size_t size = data.size() * sizeof(uint32_t);
+    if (write(fd.get(), &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            write(fd.get(), data.data(), size) != static_cast<ssize_t>(size) ||
+            rename(tmp.c_str(), m_path.c_str()) < 0)
+    {
+        if (g_verbose)
+            perror(m_path.c_str());
+        unlink(tmp.c_str());
+        return;
+    }
+    m_added.clear();
+}
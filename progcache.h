@@ -0,0 +1,61 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef PROGCACHE_H_INCLUDED
+#define PROGCACHE_H_INCLUDED
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+//On-disk cache of the compiled expressions of a configuration, see ExprWriter, so that they are not parsed on every start.
+//The whole file is keyed by a hash of the configuration file and the -m defines: if anything changes, it is built again.
+class ProgramCache
+{
+public:
+    explicit ProgramCache(uint64_t key);
+    ~ProgramCache();
+    ProgramCache(const ProgramCache &) = delete;
+    ProgramCache &operator=(const ProgramCache &) = delete;
+
+    static uint64_t make_key(const std::string &file, const std::map<std::string, std::string> &defines);
+
+    //The returned words are valid as long as the cache
+    const uint32_t *find(const std::string &text, size_t &size) const;
+    void add(const std::string &text, std::vector<uint32_t> program);
+    //Writes the file, if anything was added
+    void save();
+
+private:
+    std::string m_path;
+    uint64_t m_key;
+    void *m_map;
+    size_t m_map_size;
+    //the programs in the file
+    std::unordered_map<std::string, std::pair<const uint32_t*, size_t>> m_loaded;
+    //the programs added in this run
+    std::map<std::string, std::vector<uint32_t>> m_added;
+};
+
+#endif /* PROGCACHE_H_INCLUDED */
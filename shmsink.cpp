@@ -0,0 +1,81 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmsink.h"
+
+//Enough for a reader to be woken up late without missing relative values
+static const uint32_t g_num_frames = 256;
+
+ShmSink::ShmSink(const std::string &name, const std::vector<inputmap_shm_code> &codes)
+    :m_name(name), m_header(nullptr), m_size(0)
+{
+    if (m_name.empty() || m_name[0] != '/')
+        m_name = "/" + m_name;
+
+    m_size = inputmap_shm_size(g_num_frames, codes.size());
+    m_values.resize(codes.size());
+
+    //A segment left by a previous run is replaced, the readers that have it mapped keep the old one
+    shm_unlink(m_name.c_str());
+    int fd = shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    test(fd, m_name.c_str());
+    m_fd = FD(fd);
+    try
+    {
+        test(ftruncate(fd, m_size), "ftruncate");
+        void *p = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+            test(-1, "mmap");
+        //ftruncate() zeroes the segment
+        m_header = inputmap_shm_init(p, g_num_frames, codes.data(), codes.size());
+    }
+    catch (...)
+    {
+        shm_unlink(m_name.c_str());
+        throw;
+    }
+}
+
+ShmSink::~ShmSink()
+{
+    __atomic_store_n(&m_header->closed, 1, __ATOMIC_RELEASE);
+    munmap(m_header, m_size);
+
+    //Unlink the name only if it is still ours, a newer configuration may have replaced it
+    struct stat st1, st2;
+    int fd = shm_open(m_name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd >= 0)
+    {
+        if (fstat(fd, &st1) == 0 && fstat(m_fd.get(), &st2) == 0 && st1.st_ino == st2.st_ino)
+            shm_unlink(m_name.c_str());
+        close(fd);
+    }
+}
+
+void ShmSink::publish(int64_t time_ns, const input_event *evs, size_t count)
+{
+    for (size_t i = 0; i < count && i < m_values.size(); ++i)
+        m_values[i] = evs[i].value;
+    inputmap_shm_publish(m_header, time_ns, m_values.data());
+}
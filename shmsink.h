@@ -0,0 +1,55 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef SHMSINK_H_INCLUDED
+#define SHMSINK_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <linux/input.h>
+#include "steam/fd.h"
+#include "inputmap-shm.h"
+
+//Publishes the frames of an output device in a shared memory ring, see inputmap-shm.h
+class ShmSink
+{
+public:
+    //codes: type and code of the values of every frame, in order
+    ShmSink(const std::string &name, const std::vector<inputmap_shm_code> &codes);
+    ~ShmSink();
+    ShmSink(const ShmSink&) =delete;
+    ShmSink &operator=(const ShmSink&) =delete;
+
+    const std::string &name() const noexcept
+    { return m_name; }
+    //evs has a value for each code, in the same order
+    void publish(int64_t time_ns, const input_event *evs, size_t count);
+
+private:
+    std::string m_name;
+    FD m_fd;
+    inputmap_shm_header *m_header;
+    size_t m_size;
+    std::vector<int32_t> m_values;
+};
+
+#endif /* SHMSINK_H_INCLUDED */
@@ -0,0 +1,124 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <string.h>
+#include <algorithm>
+#include "stats.h"
+
+static std::vector<DeviceStats*> &stats_registry()
+{
+    static std::vector<DeviceStats*> registry;
+    return registry;
+}
+
+DeviceStats::DeviceStats(const char *kind)
+    :kind(kind), m_window_ns(now_ns())
+{
+    stats_registry().push_back(this);
+}
+
+DeviceStats::~DeviceStats()
+{
+    auto &registry = stats_registry();
+    registry.erase(std::remove(registry.begin(), registry.end(), this), registry.end());
+}
+
+const std::vector<DeviceStats*> &DeviceStats::all()
+{
+    return stats_registry();
+}
+
+void DeviceStats::update_rates(int64_t now)
+{
+    for (DeviceStats *s : stats_registry())
+    {
+        if (now - s->m_window_ns < RateWindowNs)
+            continue;
+        double secs = (now - s->m_window_ns) / 1e9;
+        s->events_per_sec = (s->events - s->m_window_events) / secs;
+        s->syncs_per_sec = (s->syncs - s->m_window_syncs) / secs;
+        s->writes_per_sec = (s->writes - s->m_window_writes) / secs;
+        s->m_window_ns = now;
+        s->m_window_events = s->events;
+        s->m_window_syncs = s->syncs;
+        s->m_window_writes = s->writes;
+    }
+}
+
+Histogram::Histogram()
+{
+    reset();
+}
+
+void Histogram::reset()
+{
+    memset(m_buckets, 0, sizeof(m_buckets));
+    m_count = 0;
+    m_max = 0;
+}
+
+int Histogram::bucket_index(uint64_t v)
+{
+    if (v < SUB_COUNT)
+        return v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - SUB_BITS;
+    return (shift + 1) * SUB_COUNT + ((v >> shift) & (SUB_COUNT - 1));
+}
+
+int64_t Histogram::bucket_upper(int idx)
+{
+    if (idx < SUB_COUNT)
+        return idx;
+    int shift = idx / SUB_COUNT - 1;
+    int64_t sub = SUB_COUNT + idx % SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+void Histogram::add(int64_t ns)
+{
+    if (ns < 0)
+        ns = 0;
+    ++m_buckets[bucket_index(ns)];
+    ++m_count;
+    if (ns > m_max)
+        m_max = ns;
+}
+
+int64_t Histogram::percentile(double p) const
+{
+    if (m_count == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(p * m_count);
+    if (rank >= m_count)
+        rank = m_count - 1;
+    uint64_t acc = 0;
+    for (int i = 0; i < BUCKET_COUNT; ++i)
+    {
+        acc += m_buckets[i];
+        if (acc > rank)
+        {
+            int64_t upper = bucket_upper(i);
+            return upper < m_max ? upper : m_max;
+        }
+    }
+    return m_max;
+}
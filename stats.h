@@ -0,0 +1,122 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef STATS_H_INCLUDED
+#define STATS_H_INCLUDED
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <linux/input.h>
+
+//CLOCK_MONOTONIC in nanoseconds, the same clock the input devices use for their events
+inline int64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+inline int64_t event_time_ns(const input_event &ev)
+{
+    return static_cast<int64_t>(ev.input_event_sec) * 1000000000 + ev.input_event_usec * 1000;
+}
+
+inline void set_event_time(input_event &ev, int64_t ns)
+{
+    ev.input_event_sec = ns / 1000000000;
+    ev.input_event_usec = ns % 1000000000 / 1000;
+}
+
+//Histogram of durations, in ns, with logarithmic buckets.
+//Each power of 2 is split into 8 linear sub-buckets, so the relative error is below 12.5%.
+class Histogram
+{
+public:
+    Histogram();
+    void add(int64_t ns);
+    void reset();
+
+    uint64_t count() const
+    { return m_count; }
+    int64_t max() const
+    { return m_max; }
+    //p in [0, 1]. Returns the upper bound of the bucket that holds that percentile
+    int64_t percentile(double p) const;
+
+private:
+    enum
+    {
+        SUB_BITS = 3,
+        SUB_COUNT = 1 << SUB_BITS,
+        BUCKET_COUNT = (64 - SUB_BITS) * SUB_COUNT,
+    };
+    uint64_t m_buckets[BUCKET_COUNT];
+    uint64_t m_count;
+    int64_t m_max;
+
+    static int bucket_index(uint64_t v);
+    static int64_t bucket_upper(int idx);
+};
+
+//Counters and histograms of one device, or of the main loop itself.
+//All instances are registered globally, so that the StatsServer can report them.
+class DeviceStats
+{
+public:
+    explicit DeviceStats(const char *kind);
+    ~DeviceStats();
+    DeviceStats(const DeviceStats &) = delete;
+    DeviceStats &operator=(const DeviceStats &) = delete;
+
+    const char *kind;
+    std::string name;
+
+    //durations of the pipeline stages, in ns
+    Histogram wake;     //input event to epoll_wait return
+    Histogram poll;     //on_poll(), read and decode
+    Histogram eval;     //evaluation of the expressions
+    Histogram write;    //write() to uinput
+    Histogram flush;    //InputDevice::flush()
+    Histogram latency;  //input event to the end of the uinput write
+
+    uint64_t events = 0;    //input events read
+    uint64_t syncs = 0;     //synced frames, read or written
+    uint64_t bytes = 0;     //bytes written
+    uint64_t writes = 0;    //write() calls
+    uint64_t dropped = 0;   //frames lost, such as SYN_DROPPED
+    uint64_t merged = 0;    //frames merged into a single tick
+
+    //per second, over the last whole window of update_rates()
+    double events_per_sec = 0, syncs_per_sec = 0, writes_per_sec = 0;
+
+    static const std::vector<DeviceStats*> &all();
+    //The main loop calls it at least every RateWindowNs, so the rates are the same for every reader
+    static const int64_t RateWindowNs = 1000000000;
+    static void update_rates(int64_t now);
+
+private:
+    int64_t m_window_ns;
+    uint64_t m_window_events = 0, m_window_syncs = 0, m_window_writes = 0;
+};
+
+#endif /* STATS_H_INCLUDED */
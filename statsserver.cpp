@@ -0,0 +1,151 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "statsserver.h"
+#include "stats.h"
+
+StatsServer::StatsServer(const std::string &path)
+    :m_path(path), m_start_ns(now_ns())
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("stats socket path too long: " + path);
+    strcpy(addr.sun_path, path.c_str());
+
+    m_fd = FD { socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0) };
+    test(m_fd.get(), "stats socket");
+    //only a stale socket from a previous run is replaced, never another file nor a running server
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+            throw std::runtime_error("stats socket path exists and is not a socket: " + path);
+        FD probe { socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) };
+        test(probe.get(), "stats socket");
+        if (connect(probe.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+            throw std::runtime_error("stats socket already in use: " + path);
+        unlink(path.c_str());
+    }
+    test(bind(m_fd.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), path.c_str());
+    test(listen(m_fd.get(), 4), "listen");
+}
+
+StatsServer::~StatsServer()
+{
+    unlink(m_path.c_str());
+}
+
+PollResult StatsServer::on_poll(int event)
+{
+    if ((event & EPOLLIN) == 0)
+        return PollResult::None;
+    for (;;)
+    {
+        FD client { accept4(m_fd.get(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC) };
+        if (!client)
+            break;
+        //The report is small enough to fit in the socket buffer, if it does not the reader gets a truncated report.
+        //Never block the main loop waiting for a slow reader.
+        std::string txt = report();
+        if (send(client.get(), txt.data(), txt.size(), MSG_NOSIGNAL) < 0)
+            perror("stats send");
+    }
+    return PollResult::None;
+}
+
+static std::string metric_name(const DeviceStats &s)
+{
+    std::string res = s.kind;
+    if (!s.name.empty())
+    {
+        res += '.';
+        for (char c : s.name)
+            res += (c == ' ' || c == '\t' || c == '.') ? '_' : c;
+    }
+    return res;
+}
+
+static void add_line(std::string &txt, const std::string &prefix, const char *metric, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void add_line(std::string &txt, const std::string &prefix, const char *metric, const char *fmt, ...)
+{
+    char buf[64];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    txt += prefix;
+    txt += '.';
+    txt += metric;
+    txt += ' ';
+    txt += buf;
+    txt += '\n';
+}
+
+static void add_histogram(std::string &txt, const std::string &prefix, const char *stage, const Histogram &h)
+{
+    if (h.count() == 0)
+        return;
+    std::string p = prefix + "." + stage + "_ns";
+    add_line(txt, p, "count", "%llu", static_cast<unsigned long long>(h.count()));
+    add_line(txt, p, "p50", "%lld", static_cast<long long>(h.percentile(0.50)));
+    add_line(txt, p, "p99", "%lld", static_cast<long long>(h.percentile(0.99)));
+    add_line(txt, p, "p999", "%lld", static_cast<long long>(h.percentile(0.999)));
+    add_line(txt, p, "max", "%lld", static_cast<long long>(h.max()));
+}
+
+std::string StatsServer::report()
+{
+    std::string txt;
+    int64_t now = now_ns();
+    add_line(txt, "inputmap", "uptime_sec", "%.3f", (now - m_start_ns) / 1e9);
+
+    for (DeviceStats *s : DeviceStats::all())
+    {
+        std::string prefix = metric_name(*s);
+        //the counters are never reset, and the rates are those of the last window of DeviceStats::update_rates(),
+        //so that several readers do not disturb each other
+        add_line(txt, prefix, "events", "%llu", static_cast<unsigned long long>(s->events));
+        add_line(txt, prefix, "events_per_sec", "%.1f", s->events_per_sec);
+        add_line(txt, prefix, "syncs", "%llu", static_cast<unsigned long long>(s->syncs));
+        add_line(txt, prefix, "syncs_per_sec", "%.1f", s->syncs_per_sec);
+        add_line(txt, prefix, "bytes_written", "%llu", static_cast<unsigned long long>(s->bytes));
+        add_line(txt, prefix, "writes", "%llu", static_cast<unsigned long long>(s->writes));
+        add_line(txt, prefix, "writes_per_sec", "%.1f", s->writes_per_sec);
+        add_line(txt, prefix, "dropped", "%llu", static_cast<unsigned long long>(s->dropped));
+        add_line(txt, prefix, "merged", "%llu", static_cast<unsigned long long>(s->merged));
+        add_histogram(txt, prefix, "wake", s->wake);
+        add_histogram(txt, prefix, "poll", s->poll);
+        add_histogram(txt, prefix, "eval", s->eval);
+        add_histogram(txt, prefix, "write", s->write);
+        add_histogram(txt, prefix, "flush", s->flush);
+        add_histogram(txt, prefix, "latency", s->latency);
+    }
+    return txt;
+}
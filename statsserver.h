@@ -0,0 +1,49 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef STATSSERVER_H_INCLUDED
+#define STATSSERVER_H_INCLUDED
+
+#include <string>
+#include "steam/fd.h"
+#include "inputdev.h"
+
+//Listens on a Unix socket and writes a text report of all the DeviceStats to anyone that connects.
+//Each line is "<kind>.<name>.<metric> <value>".
+class StatsServer : public IPollable
+{
+public:
+    explicit StatsServer(const std::string &path);
+    ~StatsServer();
+
+    virtual int fd() override
+    { return m_fd.get(); }
+    virtual PollResult on_poll(int event) override;
+
+private:
+    std::string m_path;
+    FD m_fd;
+    int64_t m_start_ns;
+
+    std::string report();
+};
+
+#endif /* STATSSERVER_H_INCLUDED */
@@ -0,0 +1,191 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "fd.h"
+#include <atomic>
+#include <thread>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+namespace
+{
+
+//close() of an input or hidraw device may block for tens of milliseconds, so they are closed from a worker thread.
+//Any thread may push; only the worker pops, so a lock-free stack is enough.
+//The worker does not survive a fork(), so the child starts a new one on its first push, with its own eventfd.
+class AsyncCloser
+{
+public:
+    AsyncCloser()
+        :m_head(nullptr), m_state(Stopped), m_wake(-1)
+    {
+        s_instance = this;
+        pthread_atfork(nullptr, nullptr, &AsyncCloser::on_fork_child);
+        if (!start())
+            throw std::runtime_error("cannot start the closer thread");
+    }
+    //returns false if the fd has to be closed by the caller, because the worker is not running
+    bool push(int fd)
+    {
+        if (m_state.load(std::memory_order_acquire) != Running && !start())
+            return false;
+        Node *node = new Node{fd, m_head.load(std::memory_order_relaxed)};
+        while (!m_head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+            ;
+        //Only the first push into an empty stack needs to wake the worker
+        if (!node->next)
+        {
+            uint64_t one = 1;
+            int wake = m_wake.load(std::memory_order_acquire);
+            while (write(wake, &one, sizeof(one)) < 0 && errno == EINTR)
+                ;
+        }
+        return true;
+    }
+private:
+    enum State { Stopped, Starting, Running };
+    struct Node
+    {
+        int fd;
+        Node *next;
+    };
+    std::atomic<Node*> m_head;
+    std::atomic<int> m_state;
+    std::atomic<int> m_wake;
+    static AsyncCloser *s_instance;
+
+    //Only one thread starts the worker, the others close their fds themselves meanwhile
+    bool start()
+    {
+        int expected = Stopped;
+        if (!m_state.compare_exchange_strong(expected, Starting))
+            return expected == Running;
+        int wake = m_wake.load(std::memory_order_relaxed);
+        if (wake < 0)
+        {
+            wake = eventfd(0, EFD_CLOEXEC);
+            if (wake < 0)
+            {
+                m_state.store(Stopped);
+                return false;
+            }
+            m_wake.store(wake, std::memory_order_release);
+        }
+        try
+        {
+            std::thread(&AsyncCloser::run, this, wake).detach();
+        }
+        catch (...)
+        {
+            m_state.store(Stopped);
+            return false;
+        }
+        m_state.store(Running, std::memory_order_release);
+        return true;
+    }
+    //The child has a single thread: close what the parent had queued, and start over.
+    //The eventfd is shared with the parent, whose worker would take the wake ups of the child.
+    static void on_fork_child()
+    {
+        AsyncCloser *self = s_instance;
+        self->close_all(self->m_head.exchange(nullptr));
+        int wake = self->m_wake.exchange(-1);
+        if (wake >= 0)
+            close(wake);
+        self->m_state.store(Stopped);
+    }
+
+    void run(int wake)
+    {
+        for (;;)
+        {
+            //also the fds left by a previous worker that stopped
+            Node *list = m_head.exchange(nullptr, std::memory_order_acquire);
+            //The stack is LIFO, reverse it to close the fds in the order they were released
+            Node *fifo = nullptr;
+            while (list)
+            {
+                Node *next = list->next;
+                list->next = fifo;
+                fifo = list;
+                list = next;
+            }
+            close_all(fifo);
+
+            uint64_t n;
+            if (read(wake, &n, sizeof(n)) < 0 && errno != EINTR)
+            {
+                //The next push starts a new worker with a new eventfd. This one is not closed,
+                //as a push may still be writing to it.
+                perror("closer eventfd");
+                m_wake.store(-1, std::memory_order_release);
+                m_state.store(Stopped, std::memory_order_release);
+                close_all(m_head.exchange(nullptr, std::memory_order_acquire));
+                return;
+            }
+        }
+    }
+
+    static void close_all(Node *list)
+    {
+        while (list)
+        {
+            Node *next = list->next;
+            close(list->fd);
+            delete list;
+            list = next;
+        }
+    }
+};
+
+AsyncCloser *AsyncCloser::s_instance;
+
+}
+
+void close_async(int fd) noexcept
+{
+    //Never destroyed, the worker thread may outlive any static object
+    static AsyncCloser *closer = []() -> AsyncCloser* {
+        try
+        {
+            return new AsyncCloser;
+        }
+        catch (...)
+        {
+            return nullptr;
+        }
+    }();
+    if (closer)
+    {
+        try
+        {
+            if (closer->push(fd))
+                return;
+        }
+        catch (...)
+        {
+        }
+    }
+    close(fd);
+}
@@ -28,12 +28,15 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdexcept>
 #include "unique_handle.h"
 
+//Closes the fd from a background thread, so that the caller never blocks in close()
+void close_async(int fd) noexcept;
+
 struct FileCloser
 {
     typedef UniqueHandle<int, -1> pointer;
     void operator()(pointer p) noexcept
     {
-        close(p);
+        close_async(p);
     }
 };
 typedef std::unique_ptr<int, FileCloser> FD;
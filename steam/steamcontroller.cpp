@@ -20,7 +20,14 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <stdint.h>
+#include <stdio.h>
 #include <vector>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <sys/ioctl.h>
 #include <sys/epoll.h>
 #include <linux/hidraw.h>
@@ -126,13 +133,226 @@ Known registers:
  * 0x34-0x3B: 0x0A=???
 *************/
 
+//Sends a feature report. This may block for up to 500 ms.
+static bool send_feature(int fd, const uint8_t *data, size_t size)
+{
+    unsigned char feat[65] = {0};
+    memcpy(feat + 1, data, size);
+
+    timespec x;
+    x.tv_sec = 0;
+    x.tv_nsec = 50000000; // 50 ms
+
+    //This command sometimes fails with EPIPE, particularly with the wireless device
+    //so retry a few times before giving up.
+    for (int i = 0; i < 10; ++i) // up to 500 ms
+    {
+        if (ioctl(fd, HIDIOCSFEATURE(sizeof(feat)), feat) >= 0)
+            return true;
+        nanosleep(&x, &x);
+    }
+    return false;
+}
+
+struct SteamCommand
+{
+    uint8_t data[64];
+    size_t size;
+
+    SteamCommand()
+        :size(0)
+    {}
+    SteamCommand(const std::initializer_list<uint8_t> &d)
+        :size(d.size())
+    {
+        memcpy(data, d.begin(), d.size());
+    }
+    bool operator==(const SteamCommand &o) const
+    {
+        return size == o.size && memcmp(data, o.data, size) == 0;
+    }
+};
+
+//0x87 with up to 20 registers
+static const size_t MaxRegisterWrites = 20;
+static const size_t MaxRegisterReport = 2 + 3 * MaxRegisterWrites;
+
+//Feature reports are slow and may be retried for a long time, so they are sent from a worker thread.
+//Plain commands are sent in order. Haptic pulses are kept apart, one per pad: a new pulse replaces
+//the one still pending, and a pulse is not sent until the previous one to the same pad is finished,
+//unless it preempts it. A pulse equal to the one still running is dropped.
+class SteamCommandQueue
+{
+public:
+    explicit SteamCommandQueue(int fd)
+        :m_fd(fd), m_exit(false)
+    {
+        m_thread = std::thread(&SteamCommandQueue::run, this);
+    }
+    //sends everything pending before returning
+    ~SteamCommandQueue()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_exit = true;
+        }
+        m_cond.notify_one();
+        m_thread.join();
+    }
+    void push(const SteamCommand &cmd)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            //a register write is appended to the previous one, if it has not been sent yet
+            if (cmd.data[0] == 0x87 && !m_cmds.empty() && m_cmds.back().data[0] == 0x87 &&
+                    m_cmds.back().size + cmd.size - 2 <= MaxRegisterReport)
+            {
+                SteamCommand &last = m_cmds.back();
+                memcpy(last.data + last.size, cmd.data + 2, cmd.size - 2);
+                last.size += cmd.size - 2;
+                last.data[1] += cmd.data[1];
+            }
+            else
+            {
+                m_cmds.push_back(cmd);
+            }
+        }
+        m_cond.notify_one();
+    }
+    void push_haptic(bool left, const SteamCommand &cmd, int64_t duration_us, bool preempt)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            set_haptic(m_haptic[left ? 1 : 0], cmd, duration_us, preempt, clock::now());
+        }
+        m_cond.notify_one();
+    }
+    //Both pads with a single wake up of the thread, cmds without size are skipped
+    void push_haptic_pair(const SteamCommand &left, int64_t left_us, const SteamCommand &right, int64_t right_us)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            clock::time_point now = clock::now();
+            if (left.size)
+                set_haptic(m_haptic[1], left, left_us, true, now);
+            if (right.size)
+                set_haptic(m_haptic[0], right, right_us, true, now);
+        }
+        m_cond.notify_one();
+    }
+    //Drops the pending pulse, and sends stop if one is running
+    void stop_haptic(bool left, const SteamCommand &stop)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Haptic &h = m_haptic[left ? 1 : 0];
+            clock::time_point now = clock::now();
+            h.pending = false;
+            if (h.next <= now)
+                return;
+            set_haptic(h, stop, 0, true, now);
+        }
+        m_cond.notify_one();
+    }
+    //The lock for direct access to the device, for commands with a reply
+    std::mutex &io_mutex()
+    { return m_io_mutex; }
+
+private:
+    typedef std::chrono::steady_clock clock;
+    struct Haptic
+    {
+        SteamCommand cmd;
+        bool pending = false;
+        clock::duration duration;
+        clock::time_point next;
+        //the last one sent, running until next
+        SteamCommand sent;
+    };
+
+    int m_fd;
+    std::mutex m_mutex, m_io_mutex;
+    std::condition_variable m_cond;
+    std::deque<SteamCommand> m_cmds;
+    Haptic m_haptic[2];
+    bool m_exit;
+    std::thread m_thread;
+
+    static void set_haptic(Haptic &h, const SteamCommand &cmd, int64_t duration_us, bool preempt, clock::time_point now)
+    {
+        if (h.next > now && h.sent == cmd)
+        {
+            h.pending = false;
+            return;
+        }
+        h.cmd = cmd;
+        h.pending = true;
+        h.duration = std::chrono::microseconds(duration_us);
+        if (preempt)
+            h.next = now;
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            clock::time_point now = clock::now();
+            SteamCommand cmd;
+            if (!m_cmds.empty())
+            {
+                cmd = m_cmds.front();
+                m_cmds.pop_front();
+            }
+            else
+            {
+                //if there are pending pulses, wait for the first one that can be sent
+                clock::time_point wait = clock::time_point::max();
+                for (Haptic &h : m_haptic)
+                {
+                    if (!h.pending)
+                        continue;
+                    if (h.next <= now)
+                    {
+                        cmd = h.cmd;
+                        h.sent = cmd;
+                        h.pending = false;
+                        h.next = now + h.duration;
+                        break;
+                    }
+                    wait = std::min(wait, h.next);
+                }
+                if (cmd.size == 0)
+                {
+                    //on exit the pending pulses are discarded, they are useless by now
+                    if (m_exit)
+                        return;
+                    if (wait == clock::time_point::max())
+                        m_cond.wait(lock);
+                    else
+                        m_cond.wait_until(lock, wait);
+                    continue;
+                }
+            }
+
+            lock.unlock();
+            {
+                std::lock_guard<std::mutex> io_lock(m_io_mutex);
+                if (!send_feature(m_fd, cmd.data, cmd.size))
+                    perror("steam HIDIOCSFEATURE");
+            }
+            lock.lock();
+        }
+    }
+};
+
 SteamController::SteamController(FD fd)
-    :m_fd(std::move(fd))
+    :m_fd(std::move(fd)), m_queue(new SteamCommandQueue(m_fd.get()))
 {
-    memset(m_data, 0, sizeof(m_data));
+    memset(&m_state, 0, sizeof(m_state));
 
     //remove margin in rpad, we do this unconditionally
-    write_register(0x18, 0);
+    write_registers({{0x18, 0}});
 
 #if 0
     uint8_t reply[64] = {};
@@ -144,6 +364,21 @@ SteamController::SteamController(FD fd)
 #endif
 }
 
+SteamController::SteamController(SteamController &&o)
+    :m_fd(std::move(o.m_fd)), m_queue(std::move(o.m_queue)), m_state(o.m_state)
+{
+}
+
+SteamController &SteamController::operator=(SteamController &&o)
+{
+    //the old device, if any, is restored and released when this goes out of scope
+    SteamController old(std::move(*this));
+    m_fd = std::move(o.m_fd);
+    m_queue = std::move(o.m_queue);
+    m_state = o.m_state;
+    return *this;
+}
+
 SteamController::~SteamController() noexcept
 {
     try
@@ -193,150 +428,103 @@ static inline uint8_t BH(uint16_t x)
     return x >> 8;
 }
 
-bool SteamController::on_poll(int event)
+SteamEvent SteamController::on_poll(int event)
 {
     if ((event & EPOLLIN) == 0)
-        return false;
+        return SteamEvent::None;
 
     uint8_t data[64];
     int res = read(m_fd.get(), data, sizeof(data));
     if (res == -1)
     {
         if (errno == EINTR)
-            return false;;
+            return SteamEvent::None;
         throw std::runtime_error("read error");
     }
     if (res != sizeof(data))
-        return false;
+        return SteamEvent::None;
 
     uint8_t type = data[2];
-    if (type == 3 && data[4] == 0x01) //Disconnect event
-        throw std::runtime_error("steam controller powerer off");
+    if (type == 3) //Wireless connection event
+    {
+        switch (data[4])
+        {
+        case 0x01:
+            memset(&m_state, 0, sizeof(m_state));
+            return SteamEvent::Disconnected;
+        case 0x02:
+            return SteamEvent::Connected;
+        }
+        return SteamEvent::None;
+    }
 
     if (type != 1) //input
-        return false;
+        return SteamEvent::None;
 
-    memcpy(m_data, data, sizeof(m_data));
-    return true;
+    decode(data);
+    return SteamEvent::Input;
 }
 
-/*
-static int int_sign(int x)
+void SteamController::decode(const uint8_t data[64])
 {
-    if (x < 0)
-        return -1;
-    if (x > 0)
-        return 1;
-    return 0;
-}
-*/
+    uint32_t btn = U3(data, 8);
+    int16_t x = S2(data, 16), y = -S2(data, 18);
+    int16_t *axes = m_state.axes;
 
-int SteamController::get_axis(SteamAxis axis)
-{
-    uint32_t btn = U3(m_data, 8);
-    switch (axis)
+    m_state.buttons = btn;
+    axes[SteamAxis::X] = x;
+    axes[SteamAxis::Y] = y;
+
+    //The left pad and the stick share the same fields. If both are in use the reports alternate
+    //between them, so keep the last value of the other one.
+    switch (btn & (SteamButton::LPadTouch | SteamButton::LPadAndJoy))
     {
-    case SteamAxis::X:
-        return S2(m_data, 16);
-    case SteamAxis::Y:
-        return -S2(m_data, 18);
-    case SteamAxis::StickX:
-        switch (btn & (SteamButton::LPadTouch | SteamButton::LPadAndJoy))
-        {
-        case SteamButton::LPadTouch:
-            return 0;
-        case 0:
-        case SteamButton::LPadAndJoy:
-            return m_stickX = S2(m_data, 16);
-        case SteamButton::LPadTouch | SteamButton::LPadAndJoy:
-            return m_stickX;
-        }
-    case SteamAxis::StickY:
-        switch (btn & (SteamButton::LPadTouch | SteamButton::LPadAndJoy))
-        {
-        case SteamButton::LPadTouch:
-            return 0;
-        case 0:
-        case SteamButton::LPadAndJoy:
-            return m_stickY = -S2(m_data, 18);
-        case SteamButton::LPadTouch | SteamButton::LPadAndJoy:
-            return m_stickY;
-        }
-    case SteamAxis::LPadX:
-        switch (btn & (SteamButton::LPadTouch | SteamButton::LPadAndJoy))
-        {
-        case 0:
-            return 0;
-        case SteamButton::LPadTouch:
-        case SteamButton::LPadTouch | SteamButton::LPadAndJoy:
-            return m_lpadX = S2(m_data, 16);
-        case SteamButton::LPadAndJoy:
-            return m_lpadX;
-        }
-    case SteamAxis::LPadY:
-        switch (btn & (SteamButton::LPadTouch | SteamButton::LPadAndJoy))
-        {
-        case 0:
-            return 0;
-        case SteamButton::LPadTouch:
-        case SteamButton::LPadTouch | SteamButton::LPadAndJoy:
-            return m_lpadY = -S2(m_data, 18);
-        case SteamButton::LPadAndJoy:
-            return m_lpadY;
-        }
-    case SteamAxis::RPadX:
-        return S2(m_data, 20);
-    case SteamAxis::RPadY:
-        return -S2(m_data, 22);
-    case SteamAxis::LTrigger:
-        return m_data[11];
-    case SteamAxis::RTrigger:
-        return m_data[12];
-    case SteamAxis::GyroX:
-        return S2(m_data, 34);
-    case SteamAxis::GyroY:
-        return S2(m_data, 36);
-    case SteamAxis::GyroZ:
-        return S2(m_data, 38);
-    case SteamAxis::QuatW:
-        return S2(m_data, 40);
-    case SteamAxis::QuatX:
-        return S2(m_data, 42);
-    case SteamAxis::QuatY:
-        return S2(m_data, 44);
-    case SteamAxis::QuatZ:
-        return S2(m_data, 46);
-    default:
-        return 0;
+    case 0:
+        axes[SteamAxis::StickX] = x;
+        axes[SteamAxis::StickY] = y;
+        axes[SteamAxis::LPadX] = 0;
+        axes[SteamAxis::LPadY] = 0;
+        break;
+    case SteamButton::LPadTouch:
+        axes[SteamAxis::StickX] = 0;
+        axes[SteamAxis::StickY] = 0;
+        axes[SteamAxis::LPadX] = x;
+        axes[SteamAxis::LPadY] = y;
+        break;
+    case SteamButton::LPadAndJoy:
+        axes[SteamAxis::StickX] = x;
+        axes[SteamAxis::StickY] = y;
+        break;
+    case SteamButton::LPadTouch | SteamButton::LPadAndJoy:
+        axes[SteamAxis::LPadX] = x;
+        axes[SteamAxis::LPadY] = y;
+        break;
     }
+
+    axes[SteamAxis::RPadX] = S2(data, 20);
+    axes[SteamAxis::RPadY] = -S2(data, 22);
+    axes[SteamAxis::LTrigger] = data[11];
+    axes[SteamAxis::RTrigger] = data[12];
+    axes[SteamAxis::GyroX] = S2(data, 34);
+    axes[SteamAxis::GyroY] = S2(data, 36);
+    axes[SteamAxis::GyroZ] = S2(data, 38);
+    axes[SteamAxis::QuatW] = S2(data, 40);
+    axes[SteamAxis::QuatX] = S2(data, 42);
+    axes[SteamAxis::QuatY] = S2(data, 44);
+    axes[SteamAxis::QuatZ] = S2(data, 46);
 }
 
-bool SteamController::get_button(SteamButton btn)
+bool SteamController::get_button(SteamButton btn) const
 {
     if (btn == SteamButton::LPadTouch)
         btn = static_cast<SteamButton>(SteamButton::LPadTouch | SteamButton::LPadAndJoy);
-    uint32_t btns = U3(m_data, 8);
-    return (btns & btn) != 0;
+    return (m_state.buttons & btn) != 0;
 }
 
 void SteamController::send_cmd(const std::initializer_list<uint8_t> &data)
 {
-    unsigned char feat[65] = {0};
-    memcpy(feat + 1, data.begin(), data.size());
-
-    timespec x;
-    x.tv_sec = 0;
-    x.tv_nsec = 50000000; // 50 ms
-
-    //This command sometimes fails with EPIPE, particularly with the wireless device
-    //so retry a few times before giving up.
-    for (int i = 0; i < 10; ++i) // up to 500 ms
-    {
-        if (ioctl(m_fd.get(), HIDIOCSFEATURE(sizeof(feat)), feat) >= 0)
-            return;
-        nanosleep(&x, &x);
-    }
-    throw std::runtime_error("HIDIOCSFEATURE");
+    if (!send_feature(m_fd.get(), data.begin(), data.size()))
+        throw std::runtime_error("HIDIOCSFEATURE");
 }
 
 void SteamController::recv_cmd(uint8_t reply[64])
@@ -346,93 +534,209 @@ void SteamController::recv_cmd(uint8_t reply[64])
     memcpy(reply, feat + 1, 64);
 }
 
+void SteamController::queue_cmd(const std::initializer_list<uint8_t> &data)
+{
+    if (!m_queue)
+        return;
+    m_queue->push(SteamCommand(data));
+}
 
-void SteamController::write_register(uint8_t reg, uint16_t value)
+void SteamController::write_registers(const std::initializer_list<SteamRegister> &regs)
 {
-    send_cmd({0x87, 0x03, reg, BL(value), BH(value)});
+    if (!m_queue)
+        return;
+    SteamCommand cmd;
+    for (const SteamRegister &r : regs)
+    {
+        if (cmd.size == MaxRegisterReport)
+        {
+            m_queue->push(cmd);
+            cmd = SteamCommand();
+        }
+        if (cmd.size == 0)
+        {
+            cmd.data[0] = 0x87;
+            cmd.data[1] = 0;
+            cmd.size = 2;
+        }
+        cmd.data[cmd.size++] = r.reg;
+        cmd.data[cmd.size++] = BL(r.value);
+        cmd.data[cmd.size++] = BH(r.value);
+        cmd.data[1] += 3;
+    }
+    if (cmd.size)
+        m_queue->push(cmd);
 }
 
 
 void SteamController::set_accelerometer(bool enable)
 {
-    write_register(0x30, enable? 0x14 : 0x00);
+    write_registers({{0x30, static_cast<uint16_t>(enable? 0x14 : 0x00)}});
 }
 
 void SteamController::set_emulation_mode(SteamEmulation mode)
 {
     if (mode & SteamEmulation::Keys)
-        send_cmd({0x85});
+        queue_cmd({0x85});
     else
-        send_cmd({0x81});
+        queue_cmd({0x81});
 
     //I don't know how to enable these two separately, but I know how to disable them, so...
     switch (mode & (SteamEmulation::Cursor | SteamEmulation::Mouse))
     {
     case 0:
-        write_register(0x08, 0x07);
-        write_register(0x07, 0x07);
+        write_registers({{0x08, 0x07}, {0x07, 0x07}});
         break;
     case SteamEmulation::Cursor:
-        send_cmd({0x8e});
-        write_register(0x08, 0x07);
+        queue_cmd({0x8e});
+        write_registers({{0x08, 0x07}});
         break;
     case SteamEmulation::Mouse:
-        send_cmd({0x8e});
-        write_register(0x07, 0x07);
+        queue_cmd({0x8e});
+        write_registers({{0x07, 0x07}});
         break;
     case SteamEmulation::Cursor | SteamEmulation::Mouse:
-        send_cmd({0x8e});
+        queue_cmd({0x8e});
         break;
     }
 }
 
-void SteamController::haptic(bool left, int time_on, int time_off, int cycles)
+static SteamCommand haptic_cmd(bool left, int time_on, int time_off, int cycles)
 {
-    send_cmd({0x8f, 0x08,
+    return SteamCommand{0x8f, 0x08,
         BL(left? 1 : 0),
         BL(time_on), BH(time_on),
         BL(time_off), BH(time_off),
         BL(cycles), BH(cycles),
         0,
-    });
+    };
 }
 
-void SteamController::haptic_freq(bool left, int freq, int duty, int duration)
+void SteamController::haptic(bool left, int time_on, int time_off, int cycles)
 {
+    if (!m_queue)
+        return;
+    m_queue->push_haptic(left, haptic_cmd(left, time_on, time_off, cycles), (time_on + time_off) * cycles, false);
+}
+
+SteamHaptic SteamController::haptic_pulse(int freq, int duty, int duration)
+{
+    SteamHaptic res{};
+    if (freq <= 0)
+        return res;
     int period = 1000000 / freq; //in us
     int time_on = period * duty / 100;
     int time_off = period - time_on;
-    if (time_on <= 0 || time_off < 0)
-        return;
+    if (time_on <= 0 || time_off < 0 || period > 0xFFFF)
+        return res;
     int cycles = duration / period;
-    if (cycles <= 0)
-        cycles = 1;
-    haptic(left, time_on, time_off, cycles);
+    res.time_on = time_on;
+    res.time_off = time_off;
+    res.cycles = std::max(1, std::min(cycles, 0xFFFF));
+    return res;
 }
 
-std::string SteamController::get_serial()
+void SteamController::haptic_freq(bool left, int freq, int duty, int duration)
 {
-    uint8_t reply[64] = {};
-    send_cmd({0xAE, 0x15, 0x01});
-    recv_cmd(reply);
+    SteamHaptic h = haptic_pulse(freq, duty, duration);
+    if (h.cycles)
+        haptic(left, h.time_on, h.time_off, h.cycles);
+}
+
+void SteamController::haptic_play(const SteamHaptic &left, const SteamHaptic &right)
+{
+    if (!m_queue)
+        return;
+    SteamCommand cmd_left, cmd_right;
+    if (left.cycles)
+        cmd_left = haptic_cmd(true, left.time_on, left.time_off, left.cycles);
+    if (right.cycles)
+        cmd_right = haptic_cmd(false, right.time_on, right.time_off, right.cycles);
+    m_queue->push_haptic_pair(cmd_left, int64_t(left.time_on + left.time_off) * left.cycles,
+                              cmd_right, int64_t(right.time_on + right.time_off) * right.cycles);
+}
+
+void SteamController::haptic_stop(bool left, bool right)
+{
+    if (!m_queue)
+        return;
+    //a single short pulse replaces the running one
+    if (left)
+        m_queue->stop_haptic(true, haptic_cmd(true, 1, 1, 1));
+    if (right)
+        m_queue->stop_haptic(false, haptic_cmd(false, 1, 1, 1));
+}
+
+//Queries one of the info strings (0x00: board, 0x01: serial) with command 0xAE
+static std::string get_info_string(int fd, uint8_t which)
+{
+    const uint8_t cmd[] = {0xAE, 0x15, which};
+    if (!send_feature(fd, cmd, sizeof(cmd)))
+        throw std::runtime_error("HIDIOCSFEATURE");
+    unsigned char feat[65] = {0};
+    test(ioctl(fd, HIDIOCGFEATURE(sizeof(feat)), feat), "HIDIOCGFEATURE");
+    uint8_t *reply = feat + 1;
     reply[13] = 0;
-    std::string serial = reinterpret_cast<const char *>(reply + 3);
-    return serial;
+    return reinterpret_cast<const char *>(reply + 3);
+}
+
+std::string SteamController::get_serial()
+{
+    std::lock_guard<std::mutex> lock(m_queue->io_mutex());
+    return get_info_string(m_fd.get(), 0x01);
 }
 
 std::string SteamController::get_board()
 {
-    uint8_t reply[64] = {};
-    send_cmd({0xAE, 0x15, 0x00});
-    recv_cmd(reply);
-    reply[13] = 0;
-    std::string board = reinterpret_cast<const char *>(reply + 3);
-    return board;
+    std::lock_guard<std::mutex> lock(m_queue->io_mutex());
+    return get_info_string(m_fd.get(), 0x00);
 }
 
-static std::vector<std::string> find_steam_devpaths()
+struct SteamProbe
 {
-    std::vector<std::string> res;
+    std::string devpath, syspath;
+    uint64_t usec;
+    FD fd;          //null if already in use, or if the probe failed
+    bool opened;
+    //a receiver, its serial is that of the controller paired at the moment, if any, so it is never cached
+    bool wireless;
+    std::string serial;
+    std::string error;
+};
+
+//The product ID of a hidraw device, from its hid device, or 0 if it is not from Valve
+static unsigned steam_hid_product(udev_device *hidraw)
+{
+    udev_device *hid = udev_device_get_parent_with_subsystem_devtype(hidraw, "hid", nullptr);
+    const char *id = hid ? udev_device_get_property_value(hid, "HID_ID") : nullptr;
+    unsigned bus, vendor, product;
+    if (!id || sscanf(id, "%x:%x:%x", &bus, &vendor, &product) != 3 || vendor != 0x28de)
+        return 0;
+    return product;
+}
+
+//A controller without a USB parent, such as a virtual one made with uhid, is recognized by the IDs of its hid device.
+//The bus is not checked: a virtual one on the USB bus would be taken by the kernel driver.
+static bool is_steam_hid_device(udev_device *hidraw)
+{
+    unsigned product = steam_hid_product(hidraw);
+    return product == 0x1102 || product == 0x1142;
+}
+
+static SteamProbe new_probe(udev_device *hid, const std::string &syspath)
+{
+    SteamProbe probe;
+    probe.devpath = udev_device_get_devnode(hid);
+    probe.syspath = syspath;
+    probe.usec = udev_device_usec_initialized(hid);
+    probe.opened = false;
+    probe.wireless = steam_hid_product(hid) == 0x1142;
+    return probe;
+}
+
+static std::vector<SteamProbe> find_steam_devpaths()
+{
+    std::vector<SteamProbe> res;
 
     udev_ptr ud { udev_new() };
 
@@ -452,29 +756,134 @@ static std::vector<std::string> find_steam_devpaths()
             for (const std::string &sys_hid : find_udev_devices(ud.get(), itf.get(), "hidraw", nullptr, nullptr))
             {
                 udev_device_ptr hid { udev_device_new_from_syspath(ud.get(), sys_hid.c_str()) };
-                res.push_back(udev_device_get_devnode(hid.get()));
+                res.push_back(new_probe(hid.get(), sys_hid));
             }
         }
     }
+
+    for (const std::string &sys_hid : find_udev_devices(ud.get(), nullptr, "hidraw", nullptr, nullptr))
+    {
+        udev_device_ptr hid { udev_device_new_from_syspath(ud.get(), sys_hid.c_str()) };
+        if (!hid || !udev_device_get_devnode(hid.get()))
+            continue;
+        if (udev_device_get_parent_with_subsystem_devtype(hid.get(), "usb", "usb_device") || !is_steam_hid_device(hid.get()))
+            continue;
+        res.push_back(new_probe(hid.get(), sys_hid));
+    }
     return res;
 }
 
+static ISteamSerialCache *g_serial_cache;
+
+void SteamController::SetSerialCache(ISteamSerialCache *cache)
+{
+    g_serial_cache = cache;
+}
+
+//Opens every candidate hidraw node and queries its serial number, unless it is already in the cache.
+//The queries may take a long time, particularly with the wireless receivers, so they are all done at the same time.
+static std::vector<SteamProbe> probe_steam_devices()
+{
+    std::vector<SteamProbe> probes = find_steam_devpaths();
+    std::vector<std::thread> threads;
+    for (auto &probe : probes)
+    {
+        //the empty serials cached by older versions are ignored
+        if (g_serial_cache && probe.usec && !probe.wireless &&
+                g_serial_cache->find_serial(probe.syspath, probe.usec, probe.serial) && !probe.serial.empty())
+            continue;
+        threads.emplace_back([&probe]
+        {
+            try
+            {
+                FD fd { FD_open(probe.devpath.c_str(), O_RDWR) };
+                probe.serial = get_info_string(fd.get(), 0x01);
+                probe.fd = std::move(fd);
+                probe.opened = true;
+            }
+            catch (std::exception &e)
+            {
+                probe.error = e.what();
+            }
+        });
+    }
+    for (auto &th : threads)
+        th.join();
+
+    for (auto &probe : probes)
+    {
+        printf("Device %s\n", probe.devpath.c_str());
+        if (!probe.error.empty())
+        {
+            printf("    %s\n", probe.error.c_str());
+            continue;
+        }
+        printf("Serial '%s'%s\n", probe.serial.c_str(), probe.opened ? "" : " (cached)");
+        //an empty serial is a receiver without a controller, or a failure, that may change any time
+        if (g_serial_cache && probe.usec && !probe.wireless && !probe.serial.empty())
+            g_serial_cache->add_serial(probe.syspath, probe.usec, probe.serial);
+    }
+    return probes;
+}
+
+//All the [steam] sections are matched against the same scan
+static std::unique_ptr<std::vector<SteamProbe>> g_probes;
+
 SteamController SteamController::Create(const std::string &serial)
 {
-    std::vector<std::string> devpaths = find_steam_devpaths();
-    for (const std::string &devpath : devpaths)
+    if (!g_probes)
+        g_probes.reset(new std::vector<SteamProbe>(probe_steam_devices()));
+
+    for (auto &probe : *g_probes)
     {
-        printf("Device %s\n", devpath.c_str());
-        FD fd { FD_open(devpath.c_str(), O_RDWR) };
-        SteamController sc(std::move(fd));
-        std::string detected = sc.get_serial();
-        printf("Serial '%s'\n", detected.c_str());
-        if (detected.empty())
+        if (!probe.error.empty())
+            continue;
+        if (probe.serial.empty())
             continue; //no actual device
-        //printf("Board '%s'\n", sc.get_board().c_str());
-        if (serial.empty() || serial == detected)
-            return sc;
+        if (!serial.empty() && serial != probe.serial)
+            continue;
+        if (!probe.opened)
+        {
+            //from the cache, not opened yet
+            probe.fd = FD_open(probe.devpath.c_str(), O_RDWR);
+            probe.opened = true;
+        }
+        if (!probe.fd)
+            continue; //already in use
+        return SteamController(std::move(probe.fd));
     }
     throw std::runtime_error("steam device not found");
 }
 
+static bool is_steam_usb_device(udev_device *usb)
+{
+    const char *vendor = udev_device_get_sysattr_value(usb, "idVendor");
+    const char *product = udev_device_get_sysattr_value(usb, "idProduct");
+    return vendor && product && strcmp(vendor, "28de") == 0 &&
+        (strcmp(product, "1102") == 0 || strcmp(product, "1142") == 0);
+}
+
+SteamController SteamController::Open(const std::string &syspath, const std::string &serial)
+{
+    udev_ptr ud { udev_new() };
+    udev_device_ptr hid { udev_device_new_from_syspath(ud.get(), syspath.c_str()) };
+    if (!hid || !udev_device_get_devnode(hid.get()))
+        throw std::runtime_error("device not found: " + syspath);
+    //the same checks as find_steam_devpaths()
+    udev_device *itf = udev_device_get_parent_with_subsystem_devtype(hid.get(), "usb", "usb_interface");
+    udev_device *usb = udev_device_get_parent_with_subsystem_devtype(hid.get(), "usb", "usb_device");
+    const char *protocol = itf ? udev_device_get_sysattr_value(itf, "bInterfaceProtocol") : nullptr;
+    bool steam = usb ? is_steam_usb_device(usb) && protocol && strcmp(protocol, "00") == 0 : is_steam_hid_device(hid.get());
+    if (!steam)
+        throw std::runtime_error("not a steam controller: " + syspath);
+
+    FD fd = FD_open(udev_device_get_devnode(hid.get()), O_RDWR);
+    if (!serial.empty() && get_info_string(fd.get(), 0x01) != serial)
+        throw std::runtime_error("steam device with another serial: " + syspath);
+    return SteamController(std::move(fd));
+}
+
+void SteamController::ClearProbes()
+{
+    g_probes.reset();
+}
@@ -22,6 +22,9 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef STEAMCONTROLLER_H_INCLUDED
 #define STEAMCONTROLLER_H_INCLUDED
 
+#include <stdint.h>
+#include <memory>
+#include <string>
 #include "fd.h"
 
 enum SteamAxis
@@ -43,6 +46,7 @@ enum SteamAxis
     QuatX,
     QuatY,
     QuatZ,
+    SteamAxisCount,
 };
 
 enum SteamButton
@@ -81,23 +85,80 @@ enum SteamEmulation
     Mouse   = 4, //mouse cursor, left/right buttons
 };
 
+//What a report read in on_poll() was about
+enum class SteamEvent
+{
+    None,
+    Input,          //the state() has been updated
+    Connected,      //a wireless controller has connected to the receiver, its settings are the default ones
+    Disconnected,   //a wireless controller has been powered off, the receiver remains
+};
+
+//An input report, decoded
+struct SteamState
+{
+    uint32_t buttons;
+    int16_t axes[SteamAxisCount];
+};
+
+//The parameters of a haptic pulse train, see SteamController::haptic()
+struct SteamHaptic
+{
+    uint16_t time_on, time_off, cycles; //cycles=0: no pulse
+};
+
+//A value to write in a register of the controller
+struct SteamRegister
+{
+    uint8_t reg;
+    uint16_t value;
+};
+
+class SteamCommandQueue;
+
+//A persistent cache of serial numbers, so that the devices do not need to be queried on every start.
+//Devices are identified by their syspath and udev initialization time.
+struct ISteamSerialCache
+{
+    virtual ~ISteamSerialCache() {}
+    virtual bool find_serial(const std::string &syspath, uint64_t usec, std::string &serial) =0;
+    virtual void add_serial(const std::string &syspath, uint64_t usec, const std::string &serial) =0;
+};
+
 class SteamController
 {
 public:
     static SteamController Create(const std::string &serial);
+    //Opens a hidraw device that has just been plugged, if it is a Steam controller with that serial (any if empty)
+    static SteamController Open(const std::string &syspath, const std::string &serial);
+    //Create() scans the devices only once, this closes the devices that were not used
+    static void ClearProbes();
+    //Must be set before the first Create()
+    static void SetSerialCache(ISteamSerialCache *cache);
+    //Takes a hidraw device already opened, without checking it
+    explicit SteamController(FD fd);
     ~SteamController() noexcept;
-    SteamController(SteamController &&o) = default;
+    SteamController(SteamController &&o);
+    SteamController &operator=(SteamController &&o);
 
     int fd()
     { return m_fd.get(); }
-    bool on_poll(int event);
+    SteamEvent on_poll(int event);
 
-    int get_axis(SteamAxis axis);
-    bool get_button(SteamButton btn);
+    //The last input report, decoded once when read
+    const SteamState &state() const
+    { return m_state; }
+    int get_axis(SteamAxis axis) const
+    { return m_state.axes[axis]; }
+    bool get_button(SteamButton btn) const;
 
     void set_accelerometer(bool enable);
     void set_emulation_mode(SteamEmulation mode);
 
+    //These commands are queued and sent by a worker thread, so they never block.
+    //A controller that has been moved from, such as the one of a detached device, ignores them.
+    //Pending haptic pulses to the same pad are coalesced and rate limited.
+
     //left: true=left pad, false=right pad
     //time_on, time_off: in us
     void haptic(bool left, int time_on, int time_off, int cycles);
@@ -105,18 +166,30 @@ public:
     //duty: 0-100 %
     //duration: in us
     void haptic_freq(bool left, int freq, int duty, int duration);
+    //The pulse train of haptic_freq(), to be computed once and played many times
+    static SteamHaptic haptic_pulse(int freq, int duty, int duration);
+    //Plays a pulse in each pad at once, replacing those still running.
+    //A pulse identical to the one running in that pad is ignored.
+    void haptic_play(const SteamHaptic &left, const SteamHaptic &right);
+    //Stops the pulses running or pending in those pads
+    void haptic_stop(bool left, bool right);
     std::string get_serial();
     std::string get_board();
 
 private:
     FD m_fd;
-    int16_t m_lpadX, m_lpadY, m_stickX, m_stickY;
-    uint8_t m_data[64];
+    //declared after m_fd, so that it is destroyed, and drained, before closing the device
+    std::unique_ptr<SteamCommandQueue> m_queue;
+    SteamState m_state;
 
-    SteamController(FD fd);
+    //synchronous, only for commands with a reply
     void send_cmd(const std::initializer_list<uint8_t> &data);
     void recv_cmd(uint8_t reply[64]);
-    void write_register(uint8_t reg, uint16_t value);
+    //asynchronous
+    void queue_cmd(const std::initializer_list<uint8_t> &data);
+    //as many registers as fit in each report
+    void write_registers(const std::initializer_list<SteamRegister> &regs);
+    void decode(const uint8_t data[64]);
 };
 
 #endif /* STEAMCONTROLLER_H_INCLUDED */
@@ -22,6 +22,8 @@ along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef UDEV_WRAPPER_H_INCLUDED
 #define UDEV_WRAPPER_H_INCLUDED
 
+#include <stdlib.h>
+#include <stdint.h>
 #include <memory>
 #include <vector>
 #include <string>
@@ -67,5 +69,14 @@ static inline std::vector<std::string> find_udev_devices(udev *ud, udev_device *
     return res;
 }
 
+//The time the device was initialized by udev. It changes when the device is plugged again, so together with
+//the syspath it identifies a device instance. Returns 0 if unknown.
+static inline uint64_t udev_device_usec_initialized(udev_device *dev)
+{
+    const char *usec = udev_device_get_property_value(dev, "USEC_INITIALIZED");
+    if (!usec)
+        return 0;
+    return strtoull(usec, nullptr, 10);
+}
 
 #endif /* UDEV-WRAPPER_H_INCLUDED */
@@ -0,0 +1,117 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <stdexcept>
+#include "devinput-parser.h"
+
+//Evaluates the same expressions as the build with the other value_t: without arguments it writes the values,
+//with the path of that other build it compares them, so that the fixed point functions are checked against float.
+
+bool g_verbose = false;
+
+static const char *const g_exprs[] = {
+    "hypot(0.3, 0.4)",
+    "hypot(-0.7, 0.2, 0.5)",
+    "hypot(0.001, -0.002)",
+    "hypot(100, 200)",
+    "atan2(1, 1)",
+    "atan2(-0.5, -0.8)",
+    "atan2(0.01, -1)",
+    "atan2(-1, 0.0001)",
+    "atan2(0.25, 0.9)",
+    "polar(0.6, -0.8)",
+    "polar(-0.9, -0.1)",
+    "polar(0.001, 1)",
+    "deg(90)",
+    "deg(-135.5)",
+    "deg(30) + deg(60)",
+    "between_angle(atan2(0.3, -0.9), deg(90), deg(-90))",
+    "between_angle(atan2(0.3, 0.9), deg(90), deg(-90))",
+    "between_angle(polar(-0.5, 0.5), deg(90), deg(180))",
+    "between_angle(deg(170), deg(160), deg(-160))",
+    "between_angle(deg(5), deg(350), deg(20))",
+    "between_angle(deg(-100), deg(-90), deg(90))",
+};
+
+//Q16.16 has a resolution of 1.5e-5 and the angle functions are accurate to about 1e-4 radians,
+//that a conversion with deg() scales with the angle
+static const double g_max_error = 2e-4;
+static const double g_max_rel_error = 2e-4;
+
+struct NoInputs : IInputByName
+{
+    std::shared_ptr<InputDevice> find_input(const std::string &name) override
+    { return nullptr; }
+    Variable *find_variable(const std::string &name) override
+    { return nullptr; }
+};
+
+static double evaluate(const char *text)
+{
+    NoInputs inputs;
+    std::unique_ptr<ValueExpr> expr = parse_ref(text, inputs);
+    return static_cast<double>(expr->get_value());
+}
+
+int main(int argc, char **argv)
+{
+    const size_t count = sizeof(g_exprs) / sizeof(*g_exprs);
+    try
+    {
+        if (argc < 2)
+        {
+            for (size_t i = 0; i < count; ++i)
+                printf("%.9g\n", evaluate(g_exprs[i]));
+            return 0;
+        }
+
+        FILE *f = popen(argv[1], "r");
+        if (!f)
+            throw std::runtime_error(std::string("cannot run ") + argv[1]);
+        int failed = 0;
+        double worst = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            double other;
+            if (fscanf(f, "%lg", &other) != 1)
+                throw std::runtime_error(std::string("missing values from ") + argv[1]);
+            double value = evaluate(g_exprs[i]);
+            double error = fabs(value - other);
+            worst = std::max(worst, error);
+            if (error > g_max_error + g_max_rel_error * fabs(other))
+            {
+                printf("FAIL %s: %.9g, expected %.9g\n", g_exprs[i], value, other);
+                ++failed;
+            }
+        }
+        pclose(f);
+        printf("%zu expressions, %d failed, max error %g\n", count, failed, worst);
+        return failed ? 1 : 0;
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,83 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <stdexcept>
+#include "inifile.h"
+#include "inputsteam.h"
+
+//A SteamController that is unplugged while a program plays an effect: the effects are kept, but nothing is sent.
+//The controller is a socket, the commands sent before detaching it just fail.
+
+bool g_verbose = false;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok)
+        throw std::runtime_error(what);
+}
+
+int main()
+{
+    char path[] = "/tmp/steam-detach-XXXXXX";
+    int fd = mkstemp(path);
+    try
+    {
+        test(fd, "mkstemp");
+        const char text[] = "[steam]\nname=pad\n";
+        test(write(fd, text, sizeof(text) - 1), "write");
+        close(fd);
+        IniFile ini(path);
+        unlink(path);
+
+        int sv[2];
+        test(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv), "socketpair");
+        FD peer(sv[1]);
+        InputDeviceSteam pad(*ini.find_single_section("steam"), SteamController(FD(sv[0])));
+        pad.detach();
+        check(!pad.attached(), "still attached");
+
+        ff_effect eff{};
+        eff.type = FF_RUMBLE;
+        eff.id = -1;
+        eff.u.rumble.strong_magnitude = 0x8000;
+        eff.u.rumble.weak_magnitude = 0x4000;
+        eff.replay.length = 100;
+        int id = pad.ff_upload(eff, -1);
+        check(id >= 0, "upload");
+        pad.ff_run(id, true);
+        eff.u.rumble.strong_magnitude = 0xFFFF;
+        check(pad.ff_upload(eff, id) == id, "update");
+        pad.ff_run(id, false);
+        pad.ff_run(id, true);
+        check(pad.ff_erase(id) == 0, "erase");
+        printf("rumble after detach ignored\n");
+        return 0;
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,468 @@
+/*
+
+Copyright 2017, Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
+
+This file is part of inputmap.
+
+inputmap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+inputmap is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with inputmap.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+//A virtual SteamController made with uhid, to test and benchmark the [steam] input without the hardware.
+//It answers the feature reports that inputmap sends, and streams input reports at a fixed rate,
+//either from a script or a builtin pattern.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <linux/uhid.h>
+#include <linux/input.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include "steam/fd.h"
+
+static volatile sig_atomic_t g_exit = false;
+static bool g_verbose = false;
+
+//The vendor interface of the controller: 64 byte input, output and feature reports, without report IDs
+static const uint8_t g_report_desc[] =
+{
+    0x06, 0x00, 0xFF,   //Usage Page (Vendor 0xFF00)
+    0x09, 0x01,         //Usage (1)
+    0xA1, 0x01,         //Collection (Application)
+    0x15, 0x00,         //  Logical Minimum (0)
+    0x26, 0xFF, 0x00,   //  Logical Maximum (255)
+    0x75, 0x08,         //  Report Size (8)
+    0x95, 0x40,         //  Report Count (64)
+    0x09, 0x01,         //  Usage (1)
+    0x81, 0x02,         //  Input (Data,Var,Abs)
+    0x95, 0x40,         //  Report Count (64)
+    0x09, 0x01,         //  Usage (1)
+    0x91, 0x02,         //  Output (Data,Var,Abs)
+    0x95, 0x40,         //  Report Count (64)
+    0x09, 0x01,         //  Usage (1)
+    0xB1, 0x02,         //  Feature (Data,Var,Abs)
+    0xC0,               //End Collection
+};
+
+//The fields of an input report that can be scripted, with the names and offsets of STEAM.md
+struct Field
+{
+    const char *name;
+    int offset;
+    int size; //1, 2 (signed) or 3 (buttons)
+};
+
+static const Field g_fields[] =
+{
+    {"btn", 8, 3},
+    {"tl", 11, 1},
+    {"tr", 12, 1},
+    {"lx", 16, 2},
+    {"ly", 18, 2},
+    {"rx", 20, 2},
+    {"ry", 22, 2},
+    {"acc1", 28, 2},
+    {"acc2", 30, 2},
+    {"acc3", 32, 2},
+    {"gyr1", 34, 2},
+    {"gyr2", 36, 2},
+    {"gyr3", 38, 2},
+    {"quat1", 40, 2},
+    {"quat2", 42, 2},
+    {"quat3", 44, 2},
+    {"quat4", 46, 2},
+};
+
+static void set_field(uint8_t data[64], const Field &f, int value)
+{
+    for (int i = 0; i < f.size; ++i)
+        data[f.offset + i] = (value >> (8 * i)) & 0xFF;
+}
+
+//Each line of the script is a frame, made of name=value pairs. The fields not in a line keep their previous value.
+//Empty lines and those starting with # are skipped.
+static std::vector<std::vector<uint8_t>> load_script(const char *file)
+{
+    std::ifstream ifs(file);
+    if (!ifs)
+        throw std::runtime_error(std::string("cannot open ") + file);
+    std::vector<std::vector<uint8_t>> res;
+    std::vector<uint8_t> frame(64);
+    std::string line;
+    int nline = 0;
+    while (std::getline(ifs, line))
+    {
+        ++nline;
+        std::istringstream is(line);
+        std::string item;
+        if (!(is >> item) || item[0] == '#')
+            continue;
+        do
+        {
+            auto eq = item.find('=');
+            const Field *field = nullptr;
+            for (const Field &f : g_fields)
+                if (item.compare(0, eq, f.name) == 0 && strlen(f.name) == eq)
+                    field = &f;
+            if (!field)
+                throw std::runtime_error("unknown field in line " + std::to_string(nline) + ": " + item);
+            set_field(frame.data(), *field, strtol(item.c_str() + eq + 1, nullptr, 0));
+        } while (is >> item);
+        res.push_back(frame);
+    }
+    if (res.empty())
+        throw std::runtime_error(std::string("empty script ") + file);
+    return res;
+}
+
+//The stick goes round, and A is pressed and released every second
+static void builtin_frame(uint8_t data[64], uint32_t n, int rate)
+{
+    int period = rate > 0 ? rate : 1000;
+    int phase = n % period;
+    int tri = phase < period / 2 ? phase : period - phase;
+    int x = -32767 + 65534 * tri / (period / 2 ? period / 2 : 1);
+    set_field(data, g_fields[3], x);
+    set_field(data, g_fields[4], -x);
+    set_field(data, g_fields[0], n % period < static_cast<uint32_t>(period / 2) ? 0x000080 : 0);
+}
+
+class VirtualSteam
+{
+public:
+    VirtualSteam(const std::string &serial, int bus, int product)
+        :m_fd(FD_open("/dev/uhid", O_RDWR | O_CLOEXEC)), m_serial(serial), m_product(product)
+    {
+        uhid_event ev{};
+        ev.type = UHID_CREATE2;
+        snprintf(reinterpret_cast<char*>(ev.u.create2.name), sizeof(ev.u.create2.name), "Valve Software Steam Controller");
+        snprintf(reinterpret_cast<char*>(ev.u.create2.uniq), sizeof(ev.u.create2.uniq), "%s", serial.c_str());
+        memcpy(ev.u.create2.rd_data, g_report_desc, sizeof(g_report_desc));
+        ev.u.create2.rd_size = sizeof(g_report_desc);
+        ev.u.create2.bus = bus;
+        ev.u.create2.vendor = 0x28DE;
+        ev.u.create2.product = product;
+        ev.u.create2.version = 1;
+        send(ev);
+    }
+    ~VirtualSteam()
+    {
+        uhid_event ev{};
+        ev.type = UHID_DESTROY;
+        try
+        {
+            send(ev);
+        }
+        catch (...)
+        {
+        }
+    }
+    int fd()
+    { return m_fd.get(); }
+    bool opened() const
+    { return m_opened; }
+
+    void on_event()
+    {
+        uhid_event ev;
+        int res = read(fd(), &ev, sizeof(ev));
+        if (res < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                return;
+            test(res, "read uhid");
+        }
+        switch (ev.type)
+        {
+        case UHID_OPEN:
+            m_opened = true;
+            //the wireless receiver says when the controller is connected
+            if (m_product == 0x1142)
+            {
+                uint8_t data[64] = {0x01, 0x00, 0x03, 0x01, 0x02};
+                input(data);
+            }
+            break;
+        case UHID_CLOSE:
+            m_opened = false;
+            break;
+        case UHID_SET_REPORT:
+            {
+                //the data starts with the report number, that is 0
+                const uint8_t *cmd = ev.u.set_report.data;
+                int size = ev.u.set_report.size;
+                if (ev.u.set_report.rnum == 0 && size > 0)
+                {
+                    ++cmd;
+                    --size;
+                }
+                on_command(cmd, size);
+                uhid_event reply{};
+                reply.type = UHID_SET_REPORT_REPLY;
+                reply.u.set_report_reply.id = ev.u.set_report.id;
+                send(reply);
+            }
+            break;
+        case UHID_GET_REPORT:
+            {
+                uhid_event reply{};
+                reply.type = UHID_GET_REPORT_REPLY;
+                reply.u.get_report_reply.id = ev.u.get_report.id;
+                reply.u.get_report_reply.size = 65;
+                memcpy(reply.u.get_report_reply.data + 1, m_reply, 64);
+                send(reply);
+            }
+            break;
+        }
+    }
+
+    void input(const uint8_t data[64])
+    {
+        uhid_event ev{};
+        ev.type = UHID_INPUT2;
+        ev.u.input2.size = 64;
+        memcpy(ev.u.input2.data, data, 64);
+        send(ev);
+    }
+
+    void print_summary()
+    {
+        printf("feature reports: %u\n", m_features);
+        printf("register reports: %u, writes: %u\n", m_reg_reports, m_reg_writes);
+        printf("haptic pulses: left %u, right %u\n", m_haptics[1], m_haptics[0]);
+        for (int r = 0; r < 256; ++r)
+            if (m_reg_set[r])
+                printf("register 0x%02X = 0x%04X\n", r, m_regs[r]);
+    }
+
+private:
+    FD m_fd;
+    std::string m_serial;
+    int m_product;
+    bool m_opened = false;
+    //the reply to the next HIDIOCGFEATURE, set by the previous command
+    uint8_t m_reply[64] = {};
+    uint16_t m_regs[256] = {};
+    bool m_reg_set[256] = {};
+    unsigned m_features = 0, m_reg_reports = 0, m_reg_writes = 0;
+    unsigned m_haptics[2] = {};
+
+    void send(const uhid_event &ev)
+    {
+        test(write(fd(), &ev, sizeof(ev)), "write uhid");
+    }
+
+    void on_command(const uint8_t *cmd, int size)
+    {
+        if (size <= 0)
+            return;
+        ++m_features;
+        memset(m_reply, 0, sizeof(m_reply));
+        memcpy(m_reply, cmd, std::min(size, 64));
+        switch (cmd[0])
+        {
+        case 0x87: //write registers
+            ++m_reg_reports;
+            for (int i = 2; i + 2 < size && i < 2 + cmd[1]; i += 3)
+            {
+                uint8_t reg = cmd[i];
+                m_regs[reg] = cmd[i + 1] | (cmd[i + 2] << 8);
+                m_reg_set[reg] = true;
+                ++m_reg_writes;
+                if (g_verbose)
+                    printf("register 0x%02X = 0x%04X\n", reg, m_regs[reg]);
+            }
+            break;
+        case 0x8F: //haptic
+            if (size >= 9)
+            {
+                int left = cmd[2] ? 1 : 0;
+                ++m_haptics[left];
+                if (g_verbose)
+                    printf("haptic %s on=%d off=%d cycles=%d\n", left ? "left" : "right",
+                            cmd[3] | (cmd[4] << 8), cmd[5] | (cmd[6] << 8), cmd[7] | (cmd[8] << 8));
+            }
+            break;
+        case 0xAE: //info string
+            if (size >= 3)
+            {
+                std::string info = cmd[2] == 0x01 ? m_serial : "virtual";
+                m_reply[1] = 0x15;
+                snprintf(reinterpret_cast<char*>(m_reply + 3), 11, "%s", info.c_str());
+            }
+            break;
+        case 0x83: //version info, only the product ID is meaningful
+            m_reply[1] = 5;
+            m_reply[2] = 0x01;
+            m_reply[3] = m_product & 0xFF;
+            m_reply[4] = m_product >> 8;
+            break;
+        default:
+            if (g_verbose)
+                printf("command 0x%02X\n", cmd[0]);
+            break;
+        }
+    }
+};
+
+static void help(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-v] [-w] [-s serial] [-b bus] [-r rate] [-n frames] [script]\n"
+            "  -v: print the commands received\n"
+            "  -w: the wireless receiver (1142) instead of the wired controller (1102)\n"
+            "  -s: the serial number, defaults to VIRTUAL000\n"
+            "  -b: the bus, defaults to %d (virtual), the kernel driver takes the USB bus\n"
+            "  -r: input reports per second, defaults to 250, 0 is as fast as possible\n"
+            "  -n: the number of input reports to send, defaults to forever\n"
+            "  script: a file with a frame per line, such as 'btn=0x80 lx=1000 ly=-1000', repeated in a loop\n",
+            argv0, BUS_VIRTUAL);
+    exit(EXIT_FAILURE);
+}
+
+static int64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+int main2(int argc, char **argv)
+{
+    std::string serial = "VIRTUAL000";
+    int bus = BUS_VIRTUAL, product = 0x1102, rate = 250;
+    long long frames = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "vws:b:r:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            g_verbose = true;
+            break;
+        case 'w':
+            product = 0x1142;
+            break;
+        case 's':
+            serial = optarg;
+            break;
+        case 'b':
+            bus = strtol(optarg, nullptr, 0);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'n':
+            frames = atoll(optarg);
+            break;
+        default:
+            help(argv[0]);
+        }
+    }
+    if (optind + 1 < argc || rate < 0 || frames < 0)
+        help(argv[0]);
+    std::vector<std::vector<uint8_t>> script;
+    if (optind < argc)
+        script = load_script(argv[optind]);
+
+    VirtualSteam steam(serial, bus, product);
+    printf("Virtual steam controller %04X, serial %s\n", product, serial.c_str());
+
+    int64_t period = rate ? 1000000000 / rate : 0;
+    int64_t next = now_ns();
+    uint32_t seq = 0;
+    long long sent = 0;
+    int64_t first = 0;
+    pollfd pfd{steam.fd(), POLLIN, 0};
+    while (!g_exit && (!frames || sent < frames))
+    {
+        int timeout = -1;
+        if (steam.opened())
+        {
+            int64_t wait = next - now_ns();
+            timeout = wait > 0 ? static_cast<int>((wait + 999999) / 1000000) : 0;
+        }
+        int res = poll(&pfd, 1, timeout);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            test(res, "poll");
+        }
+        if (res > 0)
+        {
+            steam.on_event();
+            continue;
+        }
+        //nobody reads the reports until the device is opened
+        if (!steam.opened())
+            continue;
+
+        uint8_t data[64] = {0x01, 0x00, 0x01, 0x3C};
+        if (script.empty())
+            builtin_frame(data, seq, rate);
+        else
+            memcpy(data, script[seq % script.size()].data(), 64);
+        data[0] = 0x01;
+        data[2] = 0x01;
+        data[3] = 0x3C;
+        data[4] = seq & 0xFF;
+        data[5] = (seq >> 8) & 0xFF;
+        data[6] = (seq >> 16) & 0xFF;
+        data[7] = seq >> 24;
+        steam.input(data);
+        ++seq;
+        if (!sent++)
+            first = now_ns();
+        next += period;
+        //do not try to catch up after a long stall
+        int64_t now = now_ns();
+        if (next < now - 100 * period)
+            next = now;
+    }
+
+    if (sent > 1)
+    {
+        double secs = (now_ns() - first) / 1e9;
+        printf("input reports: %lld, %.1f per second\n", sent, secs > 0 ? (sent - 1) / secs : 0);
+    }
+    steam.print_summary();
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sac {};
+    sac.sa_handler = [](int signo) { g_exit = true; };
+    sigaction(SIGINT, &sac, nullptr);
+    sigaction(SIGTERM, &sac, nullptr);
+
+    try
+    {
+        return main2(argc, argv);
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "\n *** Fatal error: %s\n", e.what());
+        return EXIT_FAILURE;
+    }
+}